@@ -47,6 +47,24 @@
 #include <ctype.h>
 #include <math.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <process.h>
+#define PARSON_HAS_FD_WRITE
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define PARSON_HAS_FD_WRITE
+#endif
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define PARSON_HAS_GETRANDOM
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define PARSON_HAS_ARC4RANDOM
+#endif
 
 /* Apparently sscanf is not implemented in some "standard" libraries, so don't use it, if you
  * don't have to. */
@@ -64,7 +82,24 @@
 #define STARTING_CAPACITY 16
 #define MAX_NESTING       2048
 
-#ifndef PARSON_DEFAULT_FLOAT_FORMAT
+/* 64-bit unsigned integer used for the shortest formatting of numbers */
+#if ULONG_MAX > 0xFFFFFFFFUL
+typedef unsigned long parson_u64_t;
+#define PARSON_HAS_U64
+#elif defined(_MSC_VER)
+typedef unsigned __int64 parson_u64_t;
+#define PARSON_HAS_U64
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
+typedef unsigned long long parson_u64_t;
+#define PARSON_HAS_U64
+#endif
+
+/* By default numbers are serialized with the shortest representation that parses back to the
+   same double, defining PARSON_DEFAULT_FLOAT_FORMAT makes parson use printf instead. Canonical
+   output always needs the shortest representation, so it fails without a 64-bit integer type. */
+#ifdef PARSON_HAS_U64
+#define PARSON_SHORTEST_NUMBERS
+#elif !defined(PARSON_DEFAULT_FLOAT_FORMAT)
 #define PARSON_DEFAULT_FLOAT_FORMAT "%1.17g" /* do not increase precision without incresing NUM_BUF_SIZE */
 #endif
 
@@ -72,16 +107,48 @@
 #define PARSON_NUM_BUF_SIZE 64 /* double printed with "%1.17g" shouldn't be longer than 25 bytes so let's be paranoid and use 64 */
 #endif
 
+#ifndef PARSON_STREAM_BUF_SIZE
+#define PARSON_STREAM_BUF_SIZE 4096 /* output buffer of json_serialize_to_stream, has to be larger than PARSON_NUM_BUF_SIZE */
+#endif
+
+#ifndef PARSON_SORT_BUF_SIZE
+#define PARSON_SORT_BUF_SIZE 16 /* objects with at most this many keys are sorted for canonical output without allocating */
+#endif
+
+#ifndef PARSON_INTERN_MAX_LEN
+#define PARSON_INTERN_MAX_LEN 64 /* longest string values interned by json_parse_string_ex with intern_strings set */
+#endif
+
+#ifndef PARSON_SCHEMA_STACK_SIZE
+#define PARSON_SCHEMA_STACK_SIZE 32 /* schemas nested at most this deep are checked by json_schema_check without allocating */
+#endif
+
+#ifndef PARSON_READ_CHUNK_SIZE
+#define PARSON_READ_CHUNK_SIZE 65536 /* initial buffer size when reading files */
+#endif
+
+#ifndef PARSON_IOVEC_MIN_REF_SIZE
+#define PARSON_IOVEC_MIN_REF_SIZE 256 /* runs of string characters this long are referenced by json_serialize_to_iovec instead of copied */
+#endif
+
 #ifndef PARSON_INDENT_STR
 #define PARSON_INDENT_STR "    "
 #endif
 
+#define SPACES_16 "                "
+#define TABS_16   "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+
+/* Indentation of pretty output is written from these in as few copies as possible */
+static const char parson_space_run[] = SPACES_16 SPACES_16 SPACES_16 SPACES_16 SPACES_16 SPACES_16 SPACES_16 SPACES_16;
+static const char parson_tab_run[] = TABS_16 TABS_16 TABS_16 TABS_16 TABS_16 TABS_16 TABS_16 TABS_16;
+
 #define SIZEOF_TOKEN(a)       (sizeof(a) - 1)
 #define SKIP_CHAR(str)        ((*str)++)
 #define SKIP_WHITESPACES(str) while (isspace((unsigned char)(**str))) { SKIP_CHAR(str); }
 #define MAX(a, b)             ((a) > (b) ? (a) : (b))
 
 #undef malloc
+#undef realloc
 #undef free
 
 #if defined(isnan) && defined(isinf)
@@ -91,9 +158,7 @@
 #endif
 
 #define OBJECT_INVALID_IX ((size_t)-1)
-
-static JSON_Malloc_Function parson_malloc = malloc;
-static JSON_Free_Function parson_free = free;
+#define OBJECT_MAX_CAPACITY ((size_t)-1 / 64) /* keeps cell counts and their allocation sizes from overflowing */
 
 static int parson_escape_slashes = 1;
 
@@ -103,34 +168,152 @@ static JSON_Number_Serialization_Function parson_number_serialization_function =
 
 #define IS_CONT(b) (((unsigned char)(b) & 0xC0) == 0x80) /* is utf-8 continuation byte */
 
+/* Bytewise operations on a machine word (SWAR), used to skip runs of bytes that don't need escaping */
+#define WORD_ONES  ((size_t)-1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+#define WORD_HAS_ZERO_BYTE(w)        (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+#define WORD_HAS_BYTE(w, b)          WORD_HAS_ZERO_BYTE((w) ^ (WORD_ONES * (b)))
+#define WORD_HAS_BYTE_LESS_THAN(w, b) (((w) - WORD_ONES * (b)) & ~(w) & WORD_HIGHS) /* b <= 0x80 */
+
 typedef int parson_bool_t;
 
 #define PARSON_TRUE 1
 #define PARSON_FALSE 0
 
+#if defined(_MSC_VER)
+#define PARSON_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define PARSON_THREAD_LOCAL __thread
+#else
+#define PARSON_THREAD_LOCAL /* thread allocators and slab freelists are shared, not thread safe */
+#endif
+
+/* Allocation goes through the calling thread's allocator if one is set
+   (see json_set_thread_allocator) and through the global one otherwise. */
+static void * parson_stdlib_malloc(void *ctx, size_t size) { (void)ctx; return malloc(size); }
+static void * parson_stdlib_realloc(void *ctx, void *ptr, size_t size) { (void)ctx; return realloc(ptr, size); }
+static void   parson_stdlib_free(void *ctx, void *ptr) { (void)ctx; free(ptr); }
+
+static JSON_Malloc_Function parson_legacy_malloc = NULL; /* set by json_set_allocation_functions */
+static JSON_Free_Function parson_legacy_free = NULL;
+static void * parson_legacy_malloc_adapter(void *ctx, size_t size) { (void)ctx; return parson_legacy_malloc(size); }
+static void   parson_legacy_free_adapter(void *ctx, void *ptr) { (void)ctx; parson_legacy_free(ptr); }
+
+static JSON_Allocator parson_allocator = { NULL, parson_stdlib_malloc, parson_stdlib_realloc, parson_stdlib_free };
+static PARSON_THREAD_LOCAL JSON_Allocator parson_thread_allocator;
+static PARSON_THREAD_LOCAL parson_bool_t parson_thread_allocator_set = PARSON_FALSE;
+
+#define PARSON_CURRENT_ALLOCATOR (parson_thread_allocator_set ? &parson_thread_allocator : &parson_allocator)
+
+static void * parson_malloc(size_t size) {
+    const JSON_Allocator *allocator = PARSON_CURRENT_ALLOCATOR;
+    return allocator->malloc_fun(allocator->ctx, size);
+}
+
+static void parson_free(void *ptr) {
+    const JSON_Allocator *allocator = PARSON_CURRENT_ALLOCATOR;
+    if (ptr == NULL) {
+        return;
+    }
+    allocator->free_fun(allocator->ctx, ptr);
+}
+
+/* Like realloc, but falls back to malloc+memcpy+free for allocators without realloc.
+   On failure returns NULL and ptr stays valid. */
+static void * parson_realloc(void *ptr, size_t old_size, size_t new_size) {
+    const JSON_Allocator *allocator = PARSON_CURRENT_ALLOCATOR;
+    void *new_ptr = NULL;
+    if (allocator->realloc_fun) {
+        return allocator->realloc_fun(allocator->ctx, ptr, new_size);
+    }
+    new_ptr = allocator->malloc_fun(allocator->ctx, new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    if (ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        allocator->free_fun(allocator->ctx, ptr);
+    }
+    return new_ptr;
+}
+
+/* Object keys are hashed with HalfSipHash-1-3 keyed with a per-process seed, so colliding keys
+   can't be precomputed by an attacker. Define PARSON_DJB2_HASH to use the old unseeded djb2 hash
+   or PARSON_HASH_SEED to use a fixed seed (e.g. for reproducible builds). */
+#if !defined(PARSON_FORCE_HASH_COLLISIONS) && !defined(PARSON_DJB2_HASH)
+#define PARSON_SEEDED_HASH
+#endif
+
+/* The seed is set once, by the first hash or by json_set_hash_seed. Whoever moves the state
+   from unset to setting writes it, others wait until it's ready. */
+#define HASH_SEED_UNSET 0
+#define HASH_SEED_SETTING 1
+#define HASH_SEED_READY 2
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PARSON_SEED_CAS(state, from, to) (_InterlockedCompareExchange((state), (to), (from)) == (from))
+#define PARSON_SEED_LOAD(state) (_ReadWriteBarrier(), *(state)) /* volatile accesses are ordered by MSVC */
+#define PARSON_SEED_STORE(state, value) (_ReadWriteBarrier(), *(state) = (value))
+#elif defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define PARSON_SEED_CAS(state, from, to) __sync_bool_compare_and_swap((state), (from), (to))
+#define PARSON_SEED_LOAD(state) __atomic_load_n((state), __ATOMIC_ACQUIRE)
+#define PARSON_SEED_STORE(state, value) __atomic_store_n((state), (value), __ATOMIC_RELEASE)
+#elif defined(__GNUC__)
+#define PARSON_SEED_CAS(state, from, to) __sync_bool_compare_and_swap((state), (from), (to))
+#define PARSON_SEED_LOAD(state) __sync_fetch_and_add((state), 0)
+#define PARSON_SEED_STORE(state, value) ((void)__sync_lock_test_and_set((state), (value)), __sync_synchronize())
+#else
+/* first use of the seed isn't thread safe, hash a key (or call json_set_hash_seed) before starting threads */
+#define PARSON_SEED_CAS(state, from, to) (*(state) == (from) ? (*(state) = (to), 1) : 0)
+#define PARSON_SEED_LOAD(state) (*(state))
+#define PARSON_SEED_STORE(state, value) (*(state) = (value))
+#endif
+
 typedef struct json_string {
     char *chars;
+#ifndef PARSON_COMPACT_VALUES
     size_t length;
+#endif
 } JSON_String;
 
 /* Type definitions */
 typedef union json_value_value {
     JSON_String  string;
+    char         short_string[sizeof(JSON_String)]; /* see VALUE_FLAG_SHORT_STRING */
     double       number;
-    JSON_Object *object;
-    JSON_Array  *array;
     int          boolean;
     int          null;
 } JSON_Value_Value;
 
+/* With PARSON_COMPACT_VALUES defined values don't store links to their parents and lengths of
+   strings are stored as unsigned ints, which makes a value take 16 instead of 32 bytes on 64-bit
+   platforms. json_value_get_parent always returns NULL in that mode and strings can't be longer
+   than UINT_MAX. */
 struct json_value_t {
+#ifndef PARSON_COMPACT_VALUES
     JSON_Value      *parent;
-    JSON_Value_Type  type;
+#endif
     JSON_Value_Value value;
+#ifdef PARSON_COMPACT_VALUES
+    unsigned int     string_length;
+#endif
+    unsigned char    type;
+    unsigned char    flags;
 };
 
+/* Strings that fit in JSON_Value_Value are stored inside the value itself instead of
+   a separate allocation. Characters are followed by '\0' and the last byte holds the length. */
+#define VALUE_FLAG_SHORT_STRING 0x01
+#define VALUE_FLAG_HAS_PARENT   0x02 /* only used with PARSON_COMPACT_VALUES */
+#define VALUE_FLAG_CACHE_OUTPUT 0x04 /* see json_value_set_serialization_cache */
+#define VALUE_FLAG_CACHE_HASH   0x08 /* see json_value_set_hash_cache */
+#define VALUE_FLAG_FROZEN       0x10 /* container inside a shared subtree, can't be changed (see json_value_dedupe) */
+#define VALUE_FLAG_SHARED       0x20 /* container held by several parents, counted in its cache's owners */
+#define VALUE_FLAG_INTERNED     0x40 /* string characters are JSON_Interned storage shared with other values */
+#define SHORT_STRING_MAX_LEN    (sizeof(JSON_Value_Value) - 2)
+
 struct json_object_t {
-    JSON_Value    *wrapping_value;
     size_t        *cells;
     unsigned long *hashes;
     char         **names;
@@ -141,13 +324,198 @@ struct json_object_t {
     size_t         cell_capacity;
 };
 
+/* Arrays of only numbers or only booleans can be stored packed, as a double[] or
+   a bitset, without a JSON_Value per item. The first item of another type converts
+   the array to regular (boxed) storage. */
+#define ARRAY_BOXED           0
+#define ARRAY_PACKED_NUMBERS  1
+#define ARRAY_PACKED_BOOLEANS 2
+
+#define ARRAY_NUMBERS(array)       ((double*)(array)->packed)
+#define ARRAY_BITS(array)          ((unsigned char*)(array)->packed)
+#define ARRAY_GET_BIT(array, i)    ((ARRAY_BITS(array)[(i) >> 3] >> ((i) & 7)) & 1)
+
 struct json_array_t {
-    JSON_Value  *wrapping_value;
-    JSON_Value **items;
-    size_t       count;
-    size_t       capacity;
+    JSON_Value   **items;  /* used when packing is ARRAY_BOXED */
+    void          *packed; /* used otherwise */
+    size_t         count;
+    size_t         capacity;
+    unsigned char  packing;
+};
+
+/* Serialized output of a container, kept while the container (and everything inside it) is unchanged.
+   Mutations invalidate caches of the container and all its parents, so a valid cache implies valid
+   caches of all containers inside it. Not available with PARSON_COMPACT_VALUES (no parent links). */
+#define CACHE_FORMAT_PRETTY         0x01
+#define CACHE_FORMAT_ESCAPE_SLASHES 0x02
+
+/* Input text of a parse with retain_source set, shared by parsed containers and freed with the last of them */
+typedef struct json_source_t {
+    char   *data;
+    size_t  refcount;
+} JSON_Source;
+
+/* Characters of an interned string value follow its reference count in one block */
+typedef struct json_interned_t {
+    size_t refcount;
+} JSON_Interned;
+
+#define INTERNED_HEADER(chars) ((JSON_Interned*)((char*)(chars) - sizeof(JSON_Interned)))
+
+/* Strings interned by one parse with intern_strings set, used only to find them while parsing
+   (each holds a reference, so values freed on errors can't leave stale entries) */
+typedef struct json_intern_table_t {
+    char   **strings; /* NULL in empty slots */
+    size_t  *lens;
+    size_t   count;
+    size_t   capacity; /* power of 2 */
+} JSON_Intern_Table;
+
+typedef struct json_serialization_cache_t {
+    char          *data;
+    size_t         len;
+    size_t         capacity;
+    JSON_Source   *source; /* if set, data is the container's text in source (used for any compact output) */
+    int            level;  /* indentation level of pretty output */
+    unsigned char  format; /* CACHE_FORMAT_* */
+    parson_bool_t  valid;
+    unsigned long  hash;   /* json_value_hash of the container, kept under the same rules as output */
+    parson_bool_t  hash_valid;
+    size_t         owners; /* containers holding a VALUE_FLAG_SHARED container */
+} JSON_Serialization_Cache;
+
+/* Objects and arrays are allocated in one block together with their wrapping value,
+   so the header can be found from the value (and vice versa) without a pointer. */
+typedef struct json_object_value_t {
+    JSON_Value                value;
+#ifndef PARSON_COMPACT_VALUES
+    JSON_Serialization_Cache *cache;
+#endif
+    JSON_Object               object;
+} JSON_Object_Value;
+
+typedef struct json_array_value_t {
+    JSON_Value                value;
+#ifndef PARSON_COMPACT_VALUES
+    JSON_Serialization_Cache *cache;
+#endif
+    JSON_Array                array;
+} JSON_Array_Value;
+
+/* Common beginning of JSON_Object_Value and JSON_Array_Value */
+typedef struct json_container_value_t {
+    JSON_Value                value;
+#ifndef PARSON_COMPACT_VALUES
+    JSON_Serialization_Cache *cache;
+#endif
+} JSON_Container_Value;
+
+/* Values freed while slab allocation is enabled are kept in per-thread freelists,
+   one for each value size, and reused by the next json_value_init_* call on that thread. */
+#ifndef PARSON_SLAB_MAX_FREE_NODES
+#define PARSON_SLAB_MAX_FREE_NODES 1024
+#endif
+
+#define SLAB_CLASS_VALUE  0
+#define SLAB_CLASS_OBJECT 1
+#define SLAB_CLASS_ARRAY  2
+#define SLAB_CLASS_COUNT  3
+
+typedef struct json_slab_node_t {
+    struct json_slab_node_t *next;
+} JSON_Slab_Node;
+
+static const size_t parson_slab_sizes[SLAB_CLASS_COUNT] = {
+    sizeof(JSON_Value), sizeof(JSON_Object_Value), sizeof(JSON_Array_Value)
+};
+
+static parson_bool_t parson_slab_enabled = PARSON_FALSE;
+static PARSON_THREAD_LOCAL JSON_Slab_Node *parson_slab_free_nodes[SLAB_CLASS_COUNT];
+static PARSON_THREAD_LOCAL size_t parson_slab_free_count[SLAB_CLASS_COUNT];
+
+struct json_key_t {
+    const char    *name;
+    size_t         length;
+    unsigned long  hash;
+};
+
+/* Compiled schema: ops in pre-order, an object's members (each with its key) or an
+   array's item schema right after it. Checking walks the value with a stack of frames
+   instead of recursing into the schema. */
+typedef struct json_schema_op_t {
+    const char    *name;     /* key in the parent object schema, NULL otherwise */
+    size_t         name_len;
+    unsigned long  hash;
+    size_t         count;    /* members of an object, 1 for an array with an item schema, 0 allows anything */
+    size_t         end;      /* index of the op after this one's members or item schema */
+    int            type;     /* JSONNull validates values of every type */
+} JSON_Schema_Op;
+
+typedef struct json_schema_frame_t {
+    const JSON_Value *value;
+    size_t            op;
+    size_t            next;  /* op of the next member to check */
+    size_t            i;
+    size_t            count;
+} JSON_Schema_Frame;
+
+struct json_schema_t {
+    JSON_Schema_Op *ops;     /* names of members are stored after the ops */
+    size_t          depth;   /* nesting of non-empty objects and arrays, bounds the check's stack */
 };
 
+/* Output of the serializer: a fixed buffer, a buffer that grows as needed, a buffer
+   flushed to a write function when full, a growable buffer with references to long
+   string runs (for json_serialize_to_iovec), or nothing when only the size of output is needed. */
+#define WRITER_COUNT    0
+#define WRITER_FIXED    1
+#define WRITER_GROWABLE 2
+#define WRITER_STREAM   3
+#define WRITER_IOVEC    4
+
+/* Characters referenced instead of copied, they go after the first offset bytes of buf */
+typedef struct json_writer_ref_t {
+    size_t      offset;
+    const char *data;
+    size_t      len;
+} JSON_Writer_Ref;
+
+/* How serialization uses caches of containers (see JSON_Serialization_Cache) */
+#define SERIALIZE_CACHE_NONE 0 /* only containers with VALUE_FLAG_CACHE_OUTPUT are cached */
+#define SERIALIZE_CACHE_USE  1 /* inside a cached container, all containers are cached */
+#define SERIALIZE_CACHE_FILL 2 /* value's own cache is being filled */
+#define SERIALIZE_CACHE_SKIP 3 /* value's own cache is stale and not refilled */
+
+typedef struct json_writer_t {
+    int                  mode;
+    char                *buf;
+    size_t               len;      /* bytes written (or counted) so far, unflushed bytes for streams */
+    size_t               capacity; /* size of buf, includes space for a null character */
+    parson_bool_t        failed;   /* fixed buffer is too small, allocation or write failed */
+    parson_bool_t        uncached; /* a container filling its cache couldn't store it */
+    JSON_Write_Function  write_fun;
+    void                *write_ctx;
+    const char          *indent;      /* written once per nesting level in pretty output */
+    size_t               indent_len;
+    const char          *indent_run;  /* parson_space_run or parson_tab_run if indent is made of one of them */
+    const char          *newline;
+    size_t               newline_len;
+    JSON_Writer_Ref     *refs;        /* only used by WRITER_IOVEC */
+    size_t               ref_count;
+    size_t               ref_capacity;
+    char                 scratch[PARSON_NUM_BUF_SIZE]; /* numbers are formatted here if buf has no room */
+} JSON_Writer;
+
+#ifdef PARSON_SHORTEST_NUMBERS
+#define PARSON_U64(hi, lo) (((parson_u64_t)(hi) << 32) | (parson_u64_t)(lo))
+
+/* Floating point number with a 64-bit significand: f * 2^e */
+typedef struct diy_fp_t {
+    parson_u64_t f;
+    int          e;
+} Diy_Fp;
+#endif
+
 /* Various */
 static char * read_file(const char *filename);
 static void   remove_comments(char *string, const char *start_token, const char *end_token);
@@ -161,72 +529,165 @@ static int         num_bytes_in_utf8_sequence(unsigned char c);
 static JSON_Status   verify_utf8_sequence(const unsigned char *string, int *len);
 static parson_bool_t is_valid_utf8(const char *string, size_t string_len);
 static parson_bool_t is_decimal(const char *string, size_t length);
+#ifdef PARSON_SEEDED_HASH
+#ifndef PARSON_HASH_SEED
+static unsigned int  hash_seed_mix(unsigned int h, unsigned long v);
+#endif
+static void          hash_seed_entropy(unsigned int *key);
+static void          hash_seed_store(const unsigned int *key);
+static void          get_hash_seed(unsigned int *key);
+#endif
 static unsigned long hash_string(const char *string, size_t n);
+static unsigned long hash_mix(unsigned long hash);
+static unsigned long hash_number(double num);
 
 /* JSON Object */
-static JSON_Object * json_object_make(JSON_Value *wrapping_value);
 static JSON_Status   json_object_init(JSON_Object *object, size_t capacity);
 static void          json_object_deinit(JSON_Object *object, parson_bool_t free_keys, parson_bool_t free_values);
 static JSON_Status   json_object_grow_and_rehash(JSON_Object *object);
+static JSON_Status   json_object_rehash(JSON_Object *object, size_t new_cell_capacity);
+static size_t        json_object_cell_capacity_for(size_t item_count);
 static size_t        json_object_get_cell_ix(const JSON_Object *object, const char *key, size_t key_len, unsigned long hash, parson_bool_t *out_found);
 static JSON_Status   json_object_add(JSON_Object *object, char *name, JSON_Value *value);
 static JSON_Value  * json_object_getn_value(const JSON_Object *object, const char *name, size_t name_len);
+static JSON_Value  * json_object_get_value_with_hash(const JSON_Object *object, const char *name, size_t name_len, unsigned long hash);
+static JSON_Status   json_object_set_value_with_hash(JSON_Object *object, const char *name, size_t name_len, unsigned long hash, JSON_Value *value);
 static JSON_Status   json_object_remove_internal(JSON_Object *object, const char *name, parson_bool_t free_value);
 static JSON_Status   json_object_dotremove_internal(JSON_Object *object, const char *name, parson_bool_t free_value);
-static void          json_object_free(JSON_Object *object);
 
 /* JSON Array */
-static JSON_Array * json_array_make(JSON_Value *wrapping_value);
-static JSON_Status  json_array_add(JSON_Array *array, JSON_Value *value);
+static void            json_array_init(JSON_Array *array);
+static JSON_Status     json_array_add(JSON_Array *array, JSON_Value *value);
+static JSON_Status     json_array_add_number(JSON_Array *array, double number);
+static JSON_Status     json_array_add_boolean(JSON_Array *array, int boolean);
+static void            json_array_set_bit(JSON_Array *array, size_t ix, int boolean);
+static JSON_Status     json_array_copy_packed(JSON_Array *dest, const JSON_Array *src);
+static parson_bool_t   json_array_item_equals(const JSON_Array *a, const JSON_Array *b, size_t ix, parson_bool_t exact);
 static JSON_Status  json_array_resize(JSON_Array *array, size_t new_capacity);
-static void         json_array_free(JSON_Array *array);
+static void         json_array_truncate(JSON_Array *array, size_t count);
+static JSON_Status  json_array_reserve_more(JSON_Array *array, size_t n);
+static void         json_array_deinit(JSON_Array *array);
 
 /* JSON Value */
+static int           json_value_slab_class(JSON_Value_Type type);
+static void          json_value_dealloc(JSON_Value *value);
+static JSON_Value *  json_value_make(JSON_Value_Type type);
+static void          json_value_set_parent(JSON_Value *value, JSON_Value *parent);
+static parson_bool_t json_value_has_parent(const JSON_Value *value);
+static parson_bool_t json_value_is_frozen(const JSON_Value *value);
+static void          json_value_invalidate_cache(JSON_Value *value);
+static unsigned long json_value_hash_r(const JSON_Value *value, parson_bool_t fill, parson_bool_t *out_cached);
+#ifndef PARSON_COMPACT_VALUES
+static void          json_value_drop_caches(JSON_Value *value);
+static void          json_cache_release_data(JSON_Serialization_Cache *cache);
+static JSON_Source * json_source_make(char *data);
+static void          json_source_release(JSON_Source *source);
+static JSON_Value *  json_value_set_source(JSON_Value *value, JSON_Source *source, const char *start, const char *end);
+static void          json_value_freeze(JSON_Value *value);
+static size_t        json_value_count_containers(const JSON_Value *value);
+static void          json_value_dedupe_r(JSON_Value *value, JSON_Value **table, size_t table_mask);
+static void          json_value_release_hashes(JSON_Value *value);
+#endif
+static parson_bool_t json_value_equals_r(const JSON_Value *a, const JSON_Value *b, parson_bool_t exact);
+static parson_bool_t json_number_identical(double a, double b);
 static JSON_Value * json_value_init_string_no_copy(char *string, size_t length);
-static const JSON_String * json_value_get_string_desc(const JSON_Value *value);
+static JSON_Value * json_value_init_interned_string(JSON_Intern_Table *table, const char *string, size_t length);
+static char *       json_intern_string(JSON_Intern_Table *table, const char *string, size_t length);
+static JSON_Status  json_intern_table_grow(JSON_Intern_Table *table);
+static void         json_intern_table_deinit(JSON_Intern_Table *table);
+static void         json_interned_release(char *chars);
+static JSON_Value * json_value_init_short_string(const char *string, size_t length);
+
+/* Schema */
+static void         json_schema_measure(const JSON_Value *schema, size_t depth, size_t *op_count, size_t *names_size, size_t *max_depth);
+static size_t       json_schema_emit(JSON_Schema_Op *ops, size_t ix, const JSON_Value *schema, char **names);
+static JSON_Status  json_schema_enter(const JSON_Schema *schema, size_t op_ix, const JSON_Value *value, JSON_Schema_Frame *stack, size_t *top);
 
 /* Parser */
 static JSON_Status   skip_quotes(const char **string);
 static JSON_Status   parse_utf16(const char **unprocessed, char **processed);
+static JSON_Status   process_string_into(const char *input, size_t input_len, char *output, size_t *output_len);
 static char *        process_string(const char *input, size_t input_len, size_t *output_len);
 static char *        get_quoted_string(const char **string, size_t *output_string_len);
-static JSON_Value *  parse_object_value(const char **string, size_t nesting);
-static JSON_Value *  parse_array_value(const char **string, size_t nesting);
-static JSON_Value *  parse_string_value(const char **string);
+static JSON_Value *  parse_object_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns);
+static JSON_Value *  parse_array_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns);
+static JSON_Status   parse_packed_array_item(const char **string, JSON_Array *array);
+static JSON_Value *  parse_string_value(const char **string, JSON_Intern_Table *interns);
+static JSON_Status   parse_boolean(const char **string, int *boolean);
 static JSON_Value *  parse_boolean_value(const char **string);
+static JSON_Status   parse_number(const char **string, double *number);
 static JSON_Value *  parse_number_value(const char **string);
 static JSON_Value *  parse_null_value(const char **string);
-static JSON_Value *  parse_value(const char **string, size_t nesting);
+static JSON_Value *  parse_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns);
 
 /* Serialization */
-static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, parson_bool_t is_pretty, char *num_buf);
-static int json_serialize_string(const char *string, size_t len, char *buf);
+static void json_serialize_options_from_globals(JSON_Serialize_Options *options, parson_bool_t is_pretty);
+static void          writer_init(JSON_Writer *writer, int mode, char *buf, size_t capacity);
+static JSON_Status   writer_grow(JSON_Writer *writer, size_t len);
+static parson_bool_t writer_has_room(JSON_Writer *writer, size_t len);
+static void          writer_flush(JSON_Writer *writer);
+static void          writer_write(JSON_Writer *writer, const char *data, size_t len);
+static void          writer_write_run(JSON_Writer *writer, const char *data, size_t len);
+static char *        writer_reserve(JSON_Writer *writer, size_t len);
+static void          writer_commit(JSON_Writer *writer, const char *data, size_t len);
+static void          writer_set_layout(JSON_Writer *writer, const JSON_Serialize_Options *options);
+static void          writer_write_indent(JSON_Writer *writer, int level);
+static JSON_Status   json_serialize_to_writer_r(const JSON_Value *value, JSON_Writer *writer, int level, const JSON_Serialize_Options *options, int cache_mode);
+#ifndef PARSON_COMPACT_VALUES
+static JSON_Status   json_serialize_cached(const JSON_Value *value, JSON_Writer *writer, int level, const JSON_Serialize_Options *options, int cache_mode);
+#endif
+#ifdef PARSON_SHORTEST_NUMBERS
+static Diy_Fp        diy_fp_multiply(Diy_Fp x, Diy_Fp y);
+static Diy_Fp        diy_fp_normalize(Diy_Fp x);
+static parson_bool_t grisu_round_weed(char *buf, int len, parson_u64_t distance_high_w, parson_u64_t unsafe_interval, parson_u64_t rest, parson_u64_t ten_kappa, parson_u64_t unit);
+static int           grisu_digits(Diy_Fp low, Diy_Fp w, Diy_Fp high, char *buf, int *k);
+static int           grisu3(double num, char *buf, int *k);
+static int           shortest_digits_exact(double num, char *buf, int *k);
+static int           format_shortest_number(double num, char *buf, parson_bool_t canonical);
+#endif
+static void          json_serialize_number(double num, JSON_Writer *writer, const JSON_Serialize_Options *options);
+static void          json_serialize_string(const char *string, size_t len, JSON_Writer *writer, parson_bool_t escape_slashes);
+static int           compare_names_utf16(const void *a, const void *b);
 
 /* Various */
+/* Reads the whole file in chunks instead of relying on ftell, whose long result
+   can't describe files larger than 2 GB on some platforms */
 static char * read_file(const char * filename) {
     FILE *fp = fopen(filename, "r");
-    size_t size_to_read = 0;
     size_t size_read = 0;
-    long pos;
-    char *file_contents;
+    size_t capacity = PARSON_READ_CHUNK_SIZE;
+    size_t new_capacity = 0;
+    size_t chunk_read = 0;
+    char *file_contents = NULL;
+    char *new_contents = NULL;
     if (!fp) {
         return NULL;
     }
-    fseek(fp, 0L, SEEK_END);
-    pos = ftell(fp);
-    if (pos < 0) {
-        fclose(fp);
-        return NULL;
-    }
-    size_to_read = pos;
-    rewind(fp);
-    file_contents = (char*)parson_malloc(sizeof(char) * (size_to_read + 1));
-    if (!file_contents) {
-        fclose(fp);
-        return NULL;
+    file_contents = (char*)parson_malloc(sizeof(char) * capacity);
+    while (file_contents) {
+        chunk_read = fread(file_contents + size_read, 1, capacity - size_read - 1, fp);
+        size_read += chunk_read;
+        if (ferror(fp)) {
+            break;
+        }
+        if (size_read < capacity - 1) {
+            if (feof(fp)) {
+                break;
+            }
+            continue;
+        }
+        if (capacity > (size_t)-1 / 2) {
+            break; /* can't be addressed */
+        }
+        new_capacity = capacity * 2;
+        new_contents = (char*)parson_realloc(file_contents, capacity, new_capacity);
+        if (new_contents == NULL) {
+            break;
+        }
+        file_contents = new_contents;
+        capacity = new_capacity;
     }
-    size_read = fread(file_contents, 1, size_to_read, fp);
-    if (size_read == 0 || ferror(fp)) {
+    if (!file_contents || !feof(fp) || ferror(fp) || size_read == 0) {
         fclose(fp);
         parson_free(file_contents);
         return NULL;
@@ -416,44 +877,168 @@ static parson_bool_t is_decimal(const char *string, size_t length) {
     return PARSON_TRUE;
 }
 
+#ifdef PARSON_SEEDED_HASH
+#if defined(_MSC_VER)
+static volatile long parson_hash_seed_state = HASH_SEED_UNSET;
+#else
+static volatile int parson_hash_seed_state = HASH_SEED_UNSET;
+#endif
+static unsigned int parson_hash_seed[2];
+
+#ifndef PARSON_HASH_SEED
+static unsigned int hash_seed_mix(unsigned int h, unsigned long v) {
+    h ^= (unsigned int)v ^ (unsigned int)(v >> 16 >> 16);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    return h ^ (h >> 16);
+}
+#endif
+
+/* Mixes the time, the process id and addresses randomized by ASLR, and takes bytes from the OS
+   random source where there's one. Without it the seed isn't cryptographically strong, just hard
+   enough to guess to make hash flooding impractical. */
+static void hash_seed_entropy(unsigned int *key) {
+#ifdef PARSON_HASH_SEED
+    key[0] = (unsigned int)(PARSON_HASH_SEED);
+    key[1] = (unsigned int)((PARSON_HASH_SEED) >> 16 >> 16);
+#else
+    static const char address_entropy = 0;
+    unsigned int random_bytes[2] = { 0, 0 };
+#if defined(PARSON_HAS_GETRANDOM)
+    if (getrandom(random_bytes, sizeof(random_bytes), GRND_NONBLOCK) != (long)sizeof(random_bytes)) {
+        random_bytes[0] = random_bytes[1] = 0;
+    }
+#elif defined(PARSON_HAS_ARC4RANDOM)
+    random_bytes[0] = (unsigned int)arc4random();
+    random_bytes[1] = (unsigned int)arc4random();
+#endif
+    key[0] = hash_seed_mix(random_bytes[0], (unsigned long)(size_t)&address_entropy);
+    key[0] = hash_seed_mix(key[0], (unsigned long)time(NULL));
+    key[1] = hash_seed_mix(random_bytes[1] ^ key[0], (unsigned long)(size_t)random_bytes);
+    key[1] = hash_seed_mix(key[1], (unsigned long)clock());
+#ifdef PARSON_HAS_FD_WRITE
+#if defined(_WIN32)
+    key[1] = hash_seed_mix(key[1], (unsigned long)_getpid());
+#else
+    key[1] = hash_seed_mix(key[1], (unsigned long)getpid());
+#endif
+#endif
+#endif
+}
+
+static void hash_seed_store(const unsigned int *key) {
+    parson_hash_seed[0] = key[0];
+    parson_hash_seed[1] = key[1];
+    PARSON_SEED_STORE(&parson_hash_seed_state, HASH_SEED_READY);
+}
+
+static void get_hash_seed(unsigned int *key) {
+    if (PARSON_SEED_LOAD(&parson_hash_seed_state) != HASH_SEED_READY) {
+        if (PARSON_SEED_CAS(&parson_hash_seed_state, HASH_SEED_UNSET, HASH_SEED_SETTING)) {
+            hash_seed_entropy(key);
+            hash_seed_store(key);
+            return;
+        }
+        while (PARSON_SEED_LOAD(&parson_hash_seed_state) != HASH_SEED_READY) {
+            /* another thread is setting it */
+        }
+    }
+    key[0] = parson_hash_seed[0];
+    key[1] = parson_hash_seed[1];
+}
+#endif
+
+/* unsigned int is assumed to be 32 bits wide (same as in the utf-8/utf-16 code) */
+#define HASH_ROTL(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+#define HASH_ROUND() do {\
+                        v0 += v1; v1 = HASH_ROTL(v1, 5); v1 ^= v0; v0 = HASH_ROTL(v0, 16);\
+                        v2 += v3; v3 = HASH_ROTL(v3, 8); v3 ^= v2;\
+                        v0 += v3; v3 = HASH_ROTL(v3, 7); v3 ^= v0;\
+                        v2 += v1; v1 = HASH_ROTL(v1, 13); v1 ^= v2; v2 = HASH_ROTL(v2, 16);\
+                    } while (0)
+
 static unsigned long hash_string(const char *string, size_t n) {
-#ifdef PARSON_FORCE_HASH_COLLISIONS
+#if defined(PARSON_FORCE_HASH_COLLISIONS)
     (void)string;
     (void)n;
     return 0;
-#else
+#elif defined(PARSON_DJB2_HASH)
     unsigned long hash = 5381;
-    unsigned char c;
     size_t i = 0;
     for (i = 0; i < n; i++) {
-        c = string[i];
-        if (c == '\0') {
-            break;
-        }
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+        hash = ((hash << 5) + hash) + (unsigned char)string[i]; /* hash * 33 + c */
     }
     return hash;
+#else
+    /* HalfSipHash-1-3, consumes input 4 bytes at a time */
+    const unsigned char *in = (const unsigned char*)string;
+    const unsigned char *end = in + (n & ~(size_t)3);
+    unsigned int key[2];
+    unsigned int v0, v1, v2, v3, m;
+    unsigned int b = ((unsigned int)n) << 24;
+    get_hash_seed(key);
+    v0 = key[0];
+    v1 = key[1];
+    v2 = 0x6c796765U ^ key[0];
+    v3 = 0x74656462U ^ key[1];
+    for (; in != end; in += 4) {
+        m = (unsigned int)in[0]
+          | ((unsigned int)in[1] << 8)
+          | ((unsigned int)in[2] << 16)
+          | ((unsigned int)in[3] << 24);
+        v3 ^= m;
+        HASH_ROUND();
+        v0 ^= m;
+    }
+    switch (n & 3) {
+        case 3: b |= ((unsigned int)in[2]) << 16; /* fall through */
+        case 2: b |= ((unsigned int)in[1]) << 8;  /* fall through */
+        case 1: b |= ((unsigned int)in[0]); break;
+        default: break;
+    }
+    v3 ^= b;
+    HASH_ROUND();
+    v0 ^= b;
+    v2 ^= 0xff;
+    HASH_ROUND();
+    HASH_ROUND();
+    HASH_ROUND();
+    return (unsigned long)(v1 ^ v3);
 #endif
 }
 
-/* JSON Object */
-static JSON_Object * json_object_make(JSON_Value *wrapping_value) {
-    JSON_Status res = JSONFailure;
-    JSON_Object *new_obj = (JSON_Object*)parson_malloc(sizeof(JSON_Object));
-    if (new_obj == NULL) {
-        return NULL;
+/* Finalizer of MurmurHash3 (32-bit constants, also mixes wider unsigned longs reasonably) */
+static unsigned long hash_mix(unsigned long hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bUL;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35UL;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static unsigned long hash_number(double num) {
+    unsigned int parts[sizeof(double) / sizeof(unsigned int)];
+    unsigned long hash = 0x4e554d42UL; /* "NUMB" */
+    size_t i = 0;
+    if (num == 0.0) {
+        num = 0.0; /* -0 equals 0 */
     }
-    new_obj->wrapping_value = wrapping_value;
-    res = json_object_init(new_obj, 0);
-    if (res != JSONSuccess) {
-        parson_free(new_obj);
-        return NULL;
+    memcpy(parts, &num, sizeof(parts));
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        hash = hash_mix(hash ^ parts[i]);
     }
-    return new_obj;
+    return hash;
 }
 
+#undef HASH_ROTL
+#undef HASH_ROUND
+
+/* JSON Object */
 static JSON_Status json_object_init(JSON_Object *object, size_t capacity) {
-    unsigned int i = 0;
+    size_t i = 0;
 
     object->cells = NULL;
     object->names = NULL;
@@ -463,7 +1048,7 @@ static JSON_Status json_object_init(JSON_Object *object, size_t capacity) {
 
     object->count = 0;
     object->cell_capacity = capacity;
-    object->item_capacity = (unsigned int)(capacity * 7/10);
+    object->item_capacity = capacity * 7/10;
 
     if (capacity == 0) {
         return JSONSuccess;
@@ -523,35 +1108,51 @@ static void json_object_deinit(JSON_Object *object, parson_bool_t free_keys, par
 }
 
 static JSON_Status json_object_grow_and_rehash(JSON_Object *object) {
-    JSON_Value *wrapping_value = NULL;
-    JSON_Object new_object;
-    char *key = NULL;
-    JSON_Value *value = NULL;
-    unsigned int i = 0;
     size_t new_capacity = MAX(object->cell_capacity * 2, STARTING_CAPACITY);
-    JSON_Status res = json_object_init(&new_object, new_capacity);
+    return json_object_rehash(object, new_capacity);
+}
+
+/* new_cell_capacity has to be a power of 2 big enough to hold all items */
+static JSON_Status json_object_rehash(JSON_Object *object, size_t new_cell_capacity) {
+    JSON_Object new_object;
+    size_t cell_ix = 0;
+    size_t i = 0;
+    JSON_Status res = json_object_init(&new_object, new_cell_capacity);
     if (res != JSONSuccess) {
         return JSONFailure;
     }
 
-    wrapping_value = json_object_get_wrapping_value(object);
-    new_object.wrapping_value = wrapping_value;
-
+    /* Keys are unique and their hashes are stored, so items can be placed
+       directly into the first free cell without comparing names again. */
     for (i = 0; i < object->count; i++) {
-        key = object->names[i];
-        value = object->values[i];
-        res = json_object_add(&new_object, key, value);
-        if (res != JSONSuccess) {
-            json_object_deinit(&new_object, PARSON_FALSE, PARSON_FALSE);
-            return JSONFailure;
+        cell_ix = object->hashes[i] & (new_object.cell_capacity - 1);
+        while (new_object.cells[cell_ix] != OBJECT_INVALID_IX) {
+            cell_ix = (cell_ix + 1) & (new_object.cell_capacity - 1);
         }
-        value->parent = wrapping_value;
+        new_object.names[i] = object->names[i];
+        new_object.values[i] = object->values[i];
+        new_object.hashes[i] = object->hashes[i];
+        new_object.cells[cell_ix] = i;
+        new_object.cell_ixs[i] = cell_ix;
     }
+    new_object.count = object->count;
     json_object_deinit(object, PARSON_FALSE, PARSON_FALSE);
     *object = new_object;
     return JSONSuccess;
 }
 
+/* Returns 0 if item_count is too big */
+static size_t json_object_cell_capacity_for(size_t item_count) {
+    size_t cell_capacity = 2;
+    if (item_count > OBJECT_MAX_CAPACITY) {
+        return 0;
+    }
+    while (cell_capacity * 7/10 < item_count) {
+        cell_capacity *= 2;
+    }
+    return cell_capacity;
+}
+
 static size_t json_object_get_cell_ix(const JSON_Object *object, const char *key, size_t key_len, unsigned long hash, parson_bool_t *out_found) {
     size_t cell_ix = hash & (object->cell_capacity - 1);
     size_t cell = 0;
@@ -559,7 +1160,6 @@ static size_t json_object_get_cell_ix(const JSON_Object *object, const char *key
     unsigned int i = 0;
     unsigned long hash_to_check = 0;
     const char *key_to_check = NULL;
-    size_t key_to_check_len = 0;
 
     *out_found = PARSON_FALSE;
 
@@ -574,8 +1174,7 @@ static size_t json_object_get_cell_ix(const JSON_Object *object, const char *key
             continue;
         }
         key_to_check = object->names[cell];
-        key_to_check_len = strlen(key_to_check);
-        if (key_to_check_len == key_len && strncmp(key, key_to_check, key_len) == 0) {
+        if (strncmp(key, key_to_check, key_len) == 0 && key_to_check[key_len] == '\0') {
             *out_found = PARSON_TRUE;
             return ix;
         }
@@ -589,7 +1188,7 @@ static JSON_Status json_object_add(JSON_Object *object, char *name, JSON_Value *
     size_t cell_ix = 0;
     JSON_Status res = JSONFailure;
 
-    if (!object || !name || !value) {
+    if (!object || !name || !value || json_value_is_frozen(json_object_get_wrapping_value(object))) {
         return JSONFailure;
     }
 
@@ -608,27 +1207,32 @@ static JSON_Status json_object_add(JSON_Object *object, char *name, JSON_Value *
         cell_ix = json_object_get_cell_ix(object, name, strlen(name), hash, &found);
     }
 
+    json_value_invalidate_cache(json_object_get_wrapping_value(object));
     object->names[object->count] = name;
     object->cells[cell_ix] = object->count;
     object->values[object->count] = value;
     object->cell_ixs[object->count] = cell_ix;
     object->hashes[object->count] = hash;
     object->count++;
-    value->parent = json_object_get_wrapping_value(object);
+    json_value_set_parent(value, json_object_get_wrapping_value(object));
 
     return JSONSuccess;
 }
 
 static JSON_Value * json_object_getn_value(const JSON_Object *object, const char *name, size_t name_len) {
-    unsigned long hash = 0;
+    if (!object || !name) {
+        return NULL;
+    }
+    return json_object_get_value_with_hash(object, name, name_len, hash_string(name, name_len));
+}
+
+static JSON_Value * json_object_get_value_with_hash(const JSON_Object *object, const char *name, size_t name_len, unsigned long hash) {
     parson_bool_t found = PARSON_FALSE;
     size_t cell_ix = 0;
     size_t item_ix = 0;
-    if (!object || !name) {
+    if (object->count == 0) {
         return NULL;
     }
-    hash = hash_string(name, name_len);
-    found = PARSON_FALSE;
     cell_ix = json_object_get_cell_ix(object, name, name_len, hash, &found);
     if (!found) {
         return NULL;
@@ -649,7 +1253,7 @@ static JSON_Status json_object_remove_internal(JSON_Object *object, const char *
     size_t k = 0;
     JSON_Value *val = NULL;
 
-    if (object == NULL) {
+    if (object == NULL || json_value_is_frozen(json_object_get_wrapping_value(object))) {
         return JSONFailure;
     }
 
@@ -660,6 +1264,7 @@ static JSON_Status json_object_remove_internal(JSON_Object *object, const char *
         return JSONFailure;
     }
 
+    json_value_invalidate_cache(json_object_get_wrapping_value(object));
     item_ix = object->cells[cell];
     if (free_value) {
         val = object->values[item_ix];
@@ -712,123 +1317,807 @@ static JSON_Status json_object_dotremove_internal(JSON_Object *object, const cha
     return json_object_dotremove_internal(temp_object, dot_pos + 1, free_value);
 }
 
-static void json_object_free(JSON_Object *object) {
-    json_object_deinit(object, PARSON_TRUE, PARSON_TRUE);
-    parson_free(object);
-}
-
 /* JSON Array */
-static JSON_Array * json_array_make(JSON_Value *wrapping_value) {
-    JSON_Array *new_array = (JSON_Array*)parson_malloc(sizeof(JSON_Array));
-    if (new_array == NULL) {
-        return NULL;
-    }
-    new_array->wrapping_value = wrapping_value;
-    new_array->items = (JSON_Value**)NULL;
-    new_array->capacity = 0;
-    new_array->count = 0;
-    return new_array;
+static void json_array_init(JSON_Array *array) {
+    array->items = (JSON_Value**)NULL;
+    array->packed = NULL;
+    array->capacity = 0;
+    array->count = 0;
+    array->packing = ARRAY_BOXED;
 }
 
 static JSON_Status json_array_add(JSON_Array *array, JSON_Value *value) {
+    if (json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
+    if (array->packing != ARRAY_BOXED && json_array_unpack(array) != JSONSuccess) {
+        return JSONFailure;
+    }
     if (array->count >= array->capacity) {
         size_t new_capacity = MAX(array->capacity * 2, STARTING_CAPACITY);
         if (json_array_resize(array, new_capacity) != JSONSuccess) {
             return JSONFailure;
         }
     }
-    value->parent = json_array_get_wrapping_value(array);
+    json_value_set_parent(value, json_array_get_wrapping_value(array));
     array->items[array->count] = value;
     array->count++;
     return JSONSuccess;
 }
 
-static JSON_Status json_array_resize(JSON_Array *array, size_t new_capacity) {
-    JSON_Value **new_items = NULL;
-    if (new_capacity == 0) {
-        return JSONFailure;
+/* Appends to a packed array (or an empty one, which becomes packed) */
+static JSON_Status json_array_add_number(JSON_Array *array, double number) {
+    if (array->count == 0 && array->packing != ARRAY_PACKED_NUMBERS) {
+        json_array_deinit(array);
+        array->packing = ARRAY_PACKED_NUMBERS;
     }
-    new_items = (JSON_Value**)parson_malloc(new_capacity * sizeof(JSON_Value*));
-    if (new_items == NULL) {
+    if (array->packing != ARRAY_PACKED_NUMBERS || IS_NUMBER_INVALID(number)) {
         return JSONFailure;
     }
-    if (array->items != NULL && array->count > 0) {
-        memcpy(new_items, array->items, array->count * sizeof(JSON_Value*));
+    if (array->count >= array->capacity) {
+        size_t new_capacity = MAX(array->capacity * 2, STARTING_CAPACITY);
+        if (json_array_resize(array, new_capacity) != JSONSuccess) {
+            return JSONFailure;
+        }
     }
-    parson_free(array->items);
-    array->items = new_items;
-    array->capacity = new_capacity;
+    ARRAY_NUMBERS(array)[array->count] = number;
+    array->count++;
     return JSONSuccess;
 }
 
-static void json_array_free(JSON_Array *array) {
-    size_t i;
-    for (i = 0; i < array->count; i++) {
-        json_value_free(array->items[i]);
+static JSON_Status json_array_add_boolean(JSON_Array *array, int boolean) {
+    if (array->count == 0 && array->packing != ARRAY_PACKED_BOOLEANS) {
+        json_array_deinit(array);
+        array->packing = ARRAY_PACKED_BOOLEANS;
     }
-    parson_free(array->items);
-    parson_free(array);
+    if (array->packing != ARRAY_PACKED_BOOLEANS) {
+        return JSONFailure;
+    }
+    if (array->count >= array->capacity) {
+        size_t new_capacity = MAX(array->capacity * 2, STARTING_CAPACITY);
+        if (json_array_resize(array, new_capacity) != JSONSuccess) {
+            return JSONFailure;
+        }
+    }
+    json_array_set_bit(array, array->count, boolean);
+    array->count++;
+    return JSONSuccess;
 }
 
-/* JSON Value */
-static JSON_Value * json_value_init_string_no_copy(char *string, size_t length) {
-    JSON_Value *new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
-    if (!new_value) {
-        return NULL;
+static void json_array_set_bit(JSON_Array *array, size_t ix, int boolean) {
+    unsigned char mask = (unsigned char)(1 << (ix & 7));
+    if (boolean) {
+        ARRAY_BITS(array)[ix >> 3] |= mask;
+    } else {
+        ARRAY_BITS(array)[ix >> 3] &= (unsigned char)~mask;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONString;
-    new_value->value.string.chars = string;
-    new_value->value.string.length = length;
-    return new_value;
 }
 
-/* Parser */
-static JSON_Status skip_quotes(const char **string) {
-    if (**string != '\"') {
+/* Converts a packed array to regular storage, leaves it unchanged on failure */
+JSON_Status json_array_unpack(JSON_Array *array) {
+    JSON_Value **items = NULL;
+    JSON_Value *value = NULL;
+    size_t i = 0, capacity = 0;
+    if (array == NULL || json_value_is_frozen(json_array_get_wrapping_value(array))) {
         return JSONFailure;
     }
-    SKIP_CHAR(string);
-    while (**string != '\"') {
-        if (**string == '\0') {
-            return JSONFailure;
-        } else if (**string == '\\') {
-            SKIP_CHAR(string);
-            if (**string == '\0') {
-                return JSONFailure;
+    if (array->packing == ARRAY_BOXED) {
+        return JSONSuccess;
+    }
+    capacity = MAX(array->capacity, 1);
+    items = (JSON_Value**)parson_malloc(capacity * sizeof(JSON_Value*));
+    if (items == NULL) {
+        return JSONFailure;
+    }
+    for (i = 0; i < array->count; i++) {
+        if (array->packing == ARRAY_PACKED_NUMBERS) {
+            value = json_value_init_number(ARRAY_NUMBERS(array)[i]);
+        } else {
+            value = json_value_init_boolean(ARRAY_GET_BIT(array, i));
+        }
+        if (value == NULL) {
+            while (i > 0) {
+                i--;
+                json_value_free(items[i]);
             }
+            parson_free(items);
+            return JSONFailure;
         }
-        SKIP_CHAR(string);
+        json_value_set_parent(value, json_array_get_wrapping_value(array));
+        items[i] = value;
+    }
+    parson_free(array->packed);
+    array->packed = NULL;
+    array->items = items;
+    array->capacity = capacity;
+    array->packing = ARRAY_BOXED;
+    return JSONSuccess;
+}
+
+/* dest has to be empty */
+static JSON_Status json_array_copy_packed(JSON_Array *dest, const JSON_Array *src) {
+    json_array_deinit(dest);
+    dest->packing = src->packing;
+    if (src->count == 0) {
+        return JSONSuccess;
     }
-    SKIP_CHAR(string);
+    if (json_array_resize(dest, src->count) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (src->packing == ARRAY_PACKED_NUMBERS) {
+        memcpy(dest->packed, src->packed, src->count * sizeof(double));
+    } else {
+        memcpy(dest->packed, src->packed, (src->count + 7) / 8);
+    }
+    dest->count = src->count;
     return JSONSuccess;
 }
 
-static JSON_Status parse_utf16(const char **unprocessed, char **processed) {
-    unsigned int cp, lead, trail;
-    char *processed_ptr = *processed;
-    const char *unprocessed_ptr = *unprocessed;
-    JSON_Status status = JSONFailure;
-    unprocessed_ptr++; /* skips u */
-    status = parse_utf16_hex(unprocessed_ptr, &cp);
-    if (status != JSONSuccess) {
+static parson_bool_t json_array_item_equals(const JSON_Array *a, const JSON_Array *b, size_t ix, parson_bool_t exact) {
+    JSON_Value_Type a_type = JSONError;
+    if (a->packing == ARRAY_BOXED && b->packing == ARRAY_BOXED) {
+        return json_value_equals_r(a->items[ix], b->items[ix], exact);
+    }
+    a_type = json_array_get_item_type(a, ix);
+    if (a_type != json_array_get_item_type(b, ix)) {
+        return PARSON_FALSE;
+    }
+    /* one of the arrays is packed, so items are numbers or booleans */
+    if (a_type == JSONNumber && exact) {
+        return json_number_identical(json_array_get_number(a, ix), json_array_get_number(b, ix));
+    } else if (a_type == JSONNumber) {
+        return fabs(json_array_get_number(a, ix) - json_array_get_number(b, ix)) < 0.000001; /* EPSILON */
+    }
+    return json_array_get_boolean(a, ix) == json_array_get_boolean(b, ix);
+}
+
+static JSON_Status json_array_resize(JSON_Array *array, size_t new_capacity) {
+    void *new_storage = NULL;
+    if (new_capacity == 0 || new_capacity > (size_t)-1 / MAX(sizeof(double), sizeof(JSON_Value*))) {
         return JSONFailure;
     }
-    if (cp < 0x80) {
-        processed_ptr[0] = (char)cp; /* 0xxxxxxx */
-    } else if (cp < 0x800) {
-        processed_ptr[0] = ((cp >> 6) & 0x1F) | 0xC0; /* 110xxxxx */
-        processed_ptr[1] = ((cp)      & 0x3F) | 0x80; /* 10xxxxxx */
-        processed_ptr += 1;
-    } else if (cp < 0xD800 || cp > 0xDFFF) {
-        processed_ptr[0] = ((cp >> 12) & 0x0F) | 0xE0; /* 1110xxxx */
-        processed_ptr[1] = ((cp >> 6)  & 0x3F) | 0x80; /* 10xxxxxx */
-        processed_ptr[2] = ((cp)       & 0x3F) | 0x80; /* 10xxxxxx */
-        processed_ptr += 2;
-    } else if (cp >= 0xD800 && cp <= 0xDBFF) { /* lead surrogate (0xD800..0xDBFF) */
-        lead = cp;
-        unprocessed_ptr += 4; /* should always be within the buffer, otherwise previous sscanf would fail */
-        if (*unprocessed_ptr++ != '\\' || *unprocessed_ptr++ != 'u') {
+    switch (array->packing) {
+        case ARRAY_PACKED_NUMBERS:
+            new_storage = parson_realloc(array->packed, array->capacity * sizeof(double), new_capacity * sizeof(double));
+            break;
+        case ARRAY_PACKED_BOOLEANS:
+            new_storage = parson_realloc(array->packed, (array->capacity + 7) / 8, (new_capacity + 7) / 8);
+            break;
+        default:
+            new_storage = parson_realloc(array->items,
+                                         array->capacity * sizeof(JSON_Value*),
+                                         new_capacity * sizeof(JSON_Value*));
+            break;
+    }
+    if (new_storage == NULL) {
+        return JSONFailure;
+    }
+    if (array->packing == ARRAY_BOXED) {
+        array->items = (JSON_Value**)new_storage;
+    } else {
+        array->packed = new_storage;
+    }
+    array->capacity = new_capacity;
+    return JSONSuccess;
+}
+
+/* Frees items past count, used to undo partially failed bulk appends */
+static void json_array_truncate(JSON_Array *array, size_t count) {
+    while (array->count > count) {
+        array->count--;
+        json_value_free(array->items[array->count]);
+    }
+}
+
+/* Grows geometrically like single appends, so repeated bulk appends stay linear.
+   Falls back to the exact size if the doubled capacity can't be allocated. */
+static JSON_Status json_array_reserve_more(JSON_Array *array, size_t n) {
+    size_t needed = 0, new_capacity = 0;
+    if (n > (size_t)-1 - array->count) {
+        return JSONFailure;
+    }
+    needed = array->count + n;
+    if (needed <= array->capacity) {
+        return JSONSuccess;
+    }
+    new_capacity = needed;
+    if (array->capacity <= (size_t)-1 / 2 && array->capacity * 2 > needed) {
+        new_capacity = array->capacity * 2;
+    }
+    if (json_array_resize(array, new_capacity) == JSONSuccess) {
+        return JSONSuccess;
+    }
+    return new_capacity != needed ? json_array_resize(array, needed) : JSONFailure;
+}
+
+/* Frees all items and storage, packing is kept */
+static void json_array_deinit(JSON_Array *array) {
+    size_t i;
+    if (array->packing == ARRAY_BOXED) {
+        for (i = 0; i < array->count; i++) {
+            json_value_free(array->items[i]);
+        }
+    }
+    parson_free(array->items);
+    parson_free(array->packed);
+    array->items = NULL;
+    array->packed = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
+/* JSON Value */
+static int json_value_slab_class(JSON_Value_Type type) {
+    switch (type) {
+        case JSONObject: return SLAB_CLASS_OBJECT;
+        case JSONArray:  return SLAB_CLASS_ARRAY;
+        default:         return SLAB_CLASS_VALUE;
+    }
+}
+
+static void json_value_dealloc(JSON_Value *value) {
+    int slab_class = json_value_slab_class(json_value_get_type(value));
+    JSON_Slab_Node *node = NULL;
+    if (value == NULL) {
+        return;
+    }
+    if (!parson_slab_enabled || parson_thread_allocator_set
+        || parson_slab_free_count[slab_class] >= PARSON_SLAB_MAX_FREE_NODES) {
+        parson_free(value);
+        return;
+    }
+    node = (JSON_Slab_Node*)value;
+    node->next = parson_slab_free_nodes[slab_class];
+    parson_slab_free_nodes[slab_class] = node;
+    parson_slab_free_count[slab_class]++;
+}
+
+static JSON_Value * json_value_make(JSON_Value_Type type) {
+    int slab_class = json_value_slab_class(type);
+    JSON_Value *new_value = NULL;
+    if (parson_slab_enabled && !parson_thread_allocator_set && parson_slab_free_nodes[slab_class] != NULL) {
+        new_value = (JSON_Value*)parson_slab_free_nodes[slab_class];
+        parson_slab_free_nodes[slab_class] = parson_slab_free_nodes[slab_class]->next;
+        parson_slab_free_count[slab_class]--;
+    } else {
+        new_value = (JSON_Value*)parson_malloc(parson_slab_sizes[slab_class]);
+    }
+    if (!new_value) {
+        return NULL;
+    }
+#ifndef PARSON_COMPACT_VALUES
+    new_value->parent = NULL;
+    if (slab_class != SLAB_CLASS_VALUE) {
+        ((JSON_Container_Value*)new_value)->cache = NULL;
+    }
+#endif
+    new_value->type = (unsigned char)type;
+    new_value->flags = 0;
+    return new_value;
+}
+
+static void json_value_set_parent(JSON_Value *value, JSON_Value *parent) {
+#ifdef PARSON_COMPACT_VALUES
+    if (parent) {
+        value->flags |= VALUE_FLAG_HAS_PARENT;
+    } else {
+        value->flags &= ~VALUE_FLAG_HAS_PARENT;
+    }
+#else
+    value->parent = parent;
+#endif
+}
+
+static parson_bool_t json_value_has_parent(const JSON_Value *value) {
+#ifdef PARSON_COMPACT_VALUES
+    return (value->flags & VALUE_FLAG_HAS_PARENT) != 0;
+#else
+    return value->parent != NULL || (value->flags & VALUE_FLAG_SHARED) != 0; /* shared values don't keep a parent */
+#endif
+}
+
+static parson_bool_t json_value_is_frozen(const JSON_Value *value) {
+    return value != NULL && (value->flags & VALUE_FLAG_FROZEN) != 0;
+}
+
+/* Called with the wrapping value of a container before it's changed. */
+static void json_value_invalidate_cache(JSON_Value *value) {
+#ifdef PARSON_COMPACT_VALUES
+    (void)value;
+#else
+    JSON_Serialization_Cache *cache = NULL;
+    while (value != NULL) {
+        cache = ((JSON_Container_Value*)value)->cache;
+        if (cache == NULL || (!cache->valid && !cache->hash_valid)) {
+            return; /* parents can't have valid caches either */
+        }
+        if (json_value_is_frozen(value)) {
+            return; /* shared subtrees don't change, and their parent links aren't kept */
+        }
+        cache->valid = PARSON_FALSE;
+        cache->hash_valid = PARSON_FALSE;
+        if (cache->source) {
+            json_cache_release_data(cache); /* lets the source text be freed earlier */
+        }
+        value = value->parent;
+    }
+#endif
+}
+
+/* Type tags of json_value_hash, different for every type so e.g. [] and {} don't collide */
+#define HASH_TAG_NULL    0x6e756c6cUL
+#define HASH_TAG_TRUE    0x74727565UL
+#define HASH_TAG_FALSE   0x66616c73UL
+#define HASH_TAG_STRING  0x73747269UL
+#define HASH_TAG_ARRAY   0x61727261UL
+#define HASH_TAG_OBJECT  0x6f626a65UL
+
+/* Hashes value, using valid hashes cached in containers. With fill set (or in containers with
+   VALUE_FLAG_CACHE_HASH) computed hashes are stored in every container below, so a valid hash implies
+   valid hashes inside it, as with cached output. out_cached is cleared if a hash couldn't be stored. */
+static unsigned long json_value_hash_r(const JSON_Value *value, parson_bool_t fill, parson_bool_t *out_cached) {
+    const JSON_Object *object = NULL;
+    const JSON_Array *array = NULL;
+    unsigned long hash = 0, members = 0;
+    size_t i = 0;
+    parson_bool_t cached = PARSON_TRUE;
+#ifndef PARSON_COMPACT_VALUES
+    JSON_Serialization_Cache *cache = NULL;
+#endif
+    switch (json_value_get_type(value)) {
+        case JSONObject: case JSONArray:
+            break;
+        case JSONString:
+            return hash_mix(HASH_TAG_STRING ^ hash_string(json_value_get_string(value), json_value_get_string_len(value)));
+        case JSONNumber:
+            return hash_number(json_value_get_number(value));
+        case JSONBoolean:
+            return json_value_get_boolean(value) ? HASH_TAG_TRUE : HASH_TAG_FALSE;
+        default:
+            return HASH_TAG_NULL;
+    }
+#ifndef PARSON_COMPACT_VALUES
+    cache = ((JSON_Container_Value*)value)->cache;
+    if (cache && cache->hash_valid) {
+        return cache->hash;
+    }
+    fill = fill || (value->flags & VALUE_FLAG_CACHE_HASH);
+#endif
+    if (json_value_get_type(value) == JSONObject) {
+        /* members are summed, so the order of keys doesn't matter */
+        object = json_value_get_object(value);
+        for (i = 0; i < object->count; i++) {
+            members += hash_mix(object->hashes[i] ^ hash_mix(json_value_hash_r(object->values[i], fill, &cached)));
+        }
+        hash = hash_mix(HASH_TAG_OBJECT ^ members ^ (unsigned long)object->count);
+    } else {
+        array = json_value_get_array(value);
+        hash = HASH_TAG_ARRAY;
+        for (i = 0; i < array->count; i++) {
+            if (array->packing == ARRAY_PACKED_NUMBERS) {
+                members = hash_number(ARRAY_NUMBERS(array)[i]);
+            } else if (array->packing == ARRAY_PACKED_BOOLEANS) {
+                members = ARRAY_GET_BIT(array, i) ? HASH_TAG_TRUE : HASH_TAG_FALSE;
+            } else {
+                members = json_value_hash_r(array->items[i], fill, &cached);
+            }
+            hash = hash_mix(hash * 31 + members);
+        }
+        hash = hash_mix(hash ^ (unsigned long)array->count);
+    }
+#ifndef PARSON_COMPACT_VALUES
+    if (fill && cached) {
+        if (cache == NULL) {
+            cache = (JSON_Serialization_Cache*)parson_malloc(sizeof(JSON_Serialization_Cache));
+            if (cache != NULL) {
+                memset(cache, 0, sizeof(JSON_Serialization_Cache));
+                ((JSON_Container_Value*)value)->cache = cache;
+            }
+        }
+        if (cache != NULL) {
+            cache->hash = hash;
+            cache->hash_valid = PARSON_TRUE;
+        } else {
+            cached = PARSON_FALSE;
+        }
+    }
+#endif
+    if (!cached) {
+        *out_cached = PARSON_FALSE;
+    }
+    return hash;
+}
+
+#ifndef PARSON_COMPACT_VALUES
+static void json_value_drop_caches(JSON_Value *value) {
+    JSON_Container_Value *container = (JSON_Container_Value*)value;
+    JSON_Object *object = NULL;
+    JSON_Array *array = NULL;
+    size_t i = 0;
+    if (json_value_is_frozen(value)) {
+        return; /* caches of shared subtrees can't go stale and hold their owner counts */
+    }
+    if (json_value_get_type(value) == JSONObject) {
+        object = json_value_get_object(value);
+        for (i = 0; i < object->count; i++) {
+            json_value_drop_caches(object->values[i]);
+        }
+    } else if (json_value_get_type(value) == JSONArray) {
+        array = json_value_get_array(value);
+        for (i = 0; array->packing == ARRAY_BOXED && i < array->count; i++) {
+            json_value_drop_caches(array->items[i]);
+        }
+    } else {
+        return;
+    }
+    if (container->cache) {
+        json_cache_release_data(container->cache);
+        parson_free(container->cache);
+        container->cache = NULL;
+    }
+}
+
+static void json_cache_release_data(JSON_Serialization_Cache *cache) {
+    if (cache->source) {
+        json_source_release(cache->source);
+        cache->source = NULL;
+    } else {
+        parson_free(cache->data);
+    }
+    cache->data = NULL;
+    cache->capacity = 0;
+}
+
+static JSON_Source * json_source_make(char *data) {
+    JSON_Source *source = (JSON_Source*)parson_malloc(sizeof(JSON_Source));
+    if (source == NULL) {
+        return NULL;
+    }
+    source->data = data;
+    source->refcount = 1;
+    return source;
+}
+
+static void json_source_release(JSON_Source *source) {
+    source->refcount--;
+    if (source->refcount == 0) {
+        parson_free(source->data);
+        parson_free(source);
+    }
+}
+
+/* Makes a parsed container serialize as its text between start and end, frees value on failure. */
+static JSON_Value * json_value_set_source(JSON_Value *value, JSON_Source *source, const char *start, const char *end) {
+    JSON_Serialization_Cache *cache = NULL;
+    if (value == NULL) {
+        return NULL;
+    }
+    cache = (JSON_Serialization_Cache*)parson_malloc(sizeof(JSON_Serialization_Cache));
+    if (cache == NULL) {
+        json_value_free(value); /* parents can't have a valid cache without it */
+        return NULL;
+    }
+    memset(cache, 0, sizeof(JSON_Serialization_Cache));
+    cache->data = (char*)start;
+    cache->len = (size_t)(end - start);
+    cache->source = source;
+    cache->valid = PARSON_TRUE;
+    source->refcount++;
+    ((JSON_Container_Value*)value)->cache = cache;
+    return value;
+}
+
+static void json_value_freeze(JSON_Value *value) {
+    JSON_Object *object = NULL;
+    JSON_Array *array = NULL;
+    size_t i = 0;
+    if (json_value_is_frozen(value)) {
+        return;
+    }
+    if (json_value_get_type(value) == JSONObject) {
+        object = json_value_get_object(value);
+        for (i = 0; i < object->count; i++) {
+            json_value_freeze(object->values[i]);
+        }
+    } else if (json_value_get_type(value) == JSONArray) {
+        array = json_value_get_array(value);
+        for (i = 0; array->packing == ARRAY_BOXED && i < array->count; i++) {
+            json_value_freeze(array->items[i]);
+        }
+    } else {
+        return;
+    }
+    value->flags |= VALUE_FLAG_FROZEN;
+}
+
+static size_t json_value_count_containers(const JSON_Value *value) {
+    const JSON_Object *object = NULL;
+    const JSON_Array *array = NULL;
+    size_t i = 0, count = 1;
+    if (json_value_get_type(value) == JSONObject) {
+        object = json_value_get_object(value);
+        for (i = 0; i < object->count; i++) {
+            count += json_value_count_containers(object->values[i]);
+        }
+    } else if (json_value_get_type(value) == JSONArray) {
+        array = json_value_get_array(value);
+        for (i = 0; array->packing == ARRAY_BOXED && i < array->count; i++) {
+            count += json_value_count_containers(array->items[i]);
+        }
+    } else {
+        return 0;
+    }
+    return count;
+}
+
+/* Replaces containers inside value that are equal to one already in table (open addressing by
+   cached hash) with that one. Containers are visited parents first, so a repeated subtree is
+   replaced as a whole without visiting it. */
+static void json_value_dedupe_r(JSON_Value *value, JSON_Value **table, size_t table_mask) {
+    JSON_Value **items = NULL, *item = NULL, *found = NULL;
+    JSON_Serialization_Cache *cache = NULL;
+    size_t count = 0, i = 0, ix = 0;
+    if (json_value_get_type(value) == JSONObject) {
+        items = json_value_get_object(value)->values;
+        count = json_value_get_object(value)->count;
+    } else if (json_value_get_type(value) == JSONArray && json_value_get_array(value)->packing == ARRAY_BOXED) {
+        items = json_value_get_array(value)->items;
+        count = json_value_get_array(value)->count;
+    }
+    for (i = 0; i < count; i++) {
+        item = items[i];
+        if (json_value_get_type(item) != JSONObject && json_value_get_type(item) != JSONArray) {
+            continue;
+        }
+        cache = ((JSON_Container_Value*)item)->cache;
+        ix = cache->hash & table_mask;
+        found = NULL;
+        while (table[ix] != NULL) {
+            if (((JSON_Container_Value*)table[ix])->cache->hash == cache->hash
+                && json_value_equals_r(table[ix], item, PARSON_TRUE)) {
+                found = table[ix];
+                break;
+            }
+            ix = (ix + 1) & table_mask;
+        }
+        if (found == NULL) {
+            table[ix] = item;
+            if (!json_value_is_frozen(item)) {
+                json_value_dedupe_r(item, table, table_mask);
+            }
+            continue;
+        }
+        if (found == item) {
+            continue;
+        }
+        cache = ((JSON_Container_Value*)found)->cache;
+        json_value_freeze(found);
+        if (!(found->flags & VALUE_FLAG_SHARED)) {
+            found->flags |= VALUE_FLAG_SHARED;
+            found->parent = NULL; /* it would dangle once the first parent is freed */
+            cache->owners = 1;
+        }
+        cache->owners++;
+        json_value_free(item);
+        items[i] = found;
+    }
+}
+
+/* Drops hashes filled in by json_value_dedupe outside of shared subtrees (a valid hash needs valid
+   hashes inside, so it's all or nothing) and frees cache records left with nothing in them. */
+static void json_value_release_hashes(JSON_Value *value) {
+    JSON_Container_Value *container = (JSON_Container_Value*)value;
+    JSON_Object *object = NULL;
+    JSON_Array *array = NULL;
+    size_t i = 0;
+    if (json_value_is_frozen(value)) {
+        return;
+    }
+    if (json_value_get_type(value) == JSONObject) {
+        object = json_value_get_object(value);
+        for (i = 0; i < object->count; i++) {
+            json_value_release_hashes(object->values[i]);
+        }
+    } else if (json_value_get_type(value) == JSONArray) {
+        array = json_value_get_array(value);
+        for (i = 0; array->packing == ARRAY_BOXED && i < array->count; i++) {
+            json_value_release_hashes(array->items[i]);
+        }
+    } else {
+        return;
+    }
+    if (container->cache) {
+        container->cache->hash_valid = PARSON_FALSE;
+        if (!container->cache->valid && container->cache->source == NULL) {
+            json_cache_release_data(container->cache);
+            parson_free(container->cache);
+            container->cache = NULL;
+        }
+    }
+}
+#endif
+
+static JSON_Value * json_value_init_string_no_copy(char *string, size_t length) {
+    JSON_Value *new_value = NULL;
+#ifdef PARSON_COMPACT_VALUES
+    if ((size_t)(unsigned int)length != length) {
+        return NULL;
+    }
+#endif
+    new_value = json_value_make(JSONString);
+    if (!new_value) {
+        return NULL;
+    }
+    new_value->value.string.chars = string;
+#ifdef PARSON_COMPACT_VALUES
+    new_value->string_length = (unsigned int)length;
+#else
+    new_value->value.string.length = length;
+#endif
+    return new_value;
+}
+
+static JSON_Value * json_value_init_short_string(const char *string, size_t length) {
+    JSON_Value *new_value = NULL;
+    if (length > SHORT_STRING_MAX_LEN) {
+        return NULL;
+    }
+    new_value = json_value_make(JSONString);
+    if (!new_value) {
+        return NULL;
+    }
+    new_value->flags |= VALUE_FLAG_SHORT_STRING;
+    memcpy(new_value->value.short_string, string, length);
+    new_value->value.short_string[length] = '\0';
+    new_value->value.short_string[sizeof(new_value->value.short_string) - 1] = (char)length;
+    return new_value;
+}
+
+/* Makes a string value with characters from table (interned on first use) */
+static JSON_Value * json_value_init_interned_string(JSON_Intern_Table *table, const char *string, size_t length) {
+    JSON_Value *new_value = NULL;
+    char *chars = NULL;
+    chars = json_intern_string(table, string, length);
+    if (chars == NULL) {
+        return NULL;
+    }
+    new_value = json_value_init_string_no_copy(chars, length);
+    if (new_value == NULL) {
+        json_interned_release(chars);
+        return NULL;
+    }
+    new_value->flags |= VALUE_FLAG_INTERNED;
+    return new_value;
+}
+
+/* Returns interned characters equal to string with a reference taken for the caller */
+static char * json_intern_string(JSON_Intern_Table *table, const char *string, size_t length) {
+    JSON_Interned *interned = NULL;
+    char *chars = NULL;
+    size_t ix = 0;
+    if (table->count * 2 >= table->capacity && json_intern_table_grow(table) != JSONSuccess) {
+        return NULL;
+    }
+    ix = hash_string(string, length) & (table->capacity - 1);
+    while (table->strings[ix] != NULL) {
+        if (table->lens[ix] == length && memcmp(table->strings[ix], string, length) == 0) {
+            INTERNED_HEADER(table->strings[ix])->refcount++;
+            return table->strings[ix];
+        }
+        ix = (ix + 1) & (table->capacity - 1);
+    }
+    interned = (JSON_Interned*)parson_malloc(sizeof(JSON_Interned) + length + 1);
+    if (interned == NULL) {
+        return NULL;
+    }
+    interned->refcount = 2; /* the table's and the caller's */
+    chars = (char*)(interned + 1);
+    memcpy(chars, string, length);
+    chars[length] = '\0';
+    table->strings[ix] = chars;
+    table->lens[ix] = length;
+    table->count++;
+    return chars;
+}
+
+static JSON_Status json_intern_table_grow(JSON_Intern_Table *table) {
+    size_t new_capacity = MAX(table->capacity * 2, STARTING_CAPACITY * 4);
+    char **new_strings = NULL;
+    size_t *new_lens = NULL;
+    size_t i = 0, ix = 0;
+    new_strings = (char**)parson_malloc(new_capacity * sizeof(char*));
+    new_lens = (size_t*)parson_malloc(new_capacity * sizeof(size_t));
+    if (new_strings == NULL || new_lens == NULL) {
+        parson_free(new_strings);
+        parson_free(new_lens);
+        return JSONFailure;
+    }
+    memset(new_strings, 0, new_capacity * sizeof(char*));
+    for (i = 0; i < table->capacity; i++) {
+        if (table->strings[i] == NULL) {
+            continue;
+        }
+        ix = hash_string(table->strings[i], table->lens[i]) & (new_capacity - 1);
+        while (new_strings[ix] != NULL) {
+            ix = (ix + 1) & (new_capacity - 1);
+        }
+        new_strings[ix] = table->strings[i];
+        new_lens[ix] = table->lens[i];
+    }
+    parson_free(table->strings);
+    parson_free(table->lens);
+    table->strings = new_strings;
+    table->lens = new_lens;
+    table->capacity = new_capacity;
+    return JSONSuccess;
+}
+
+static void json_intern_table_deinit(JSON_Intern_Table *table) {
+    size_t i = 0;
+    for (i = 0; i < table->capacity; i++) {
+        if (table->strings[i] != NULL) {
+            json_interned_release(table->strings[i]);
+        }
+    }
+    parson_free(table->strings);
+    parson_free(table->lens);
+}
+
+static void json_interned_release(char *chars) {
+    JSON_Interned *interned = INTERNED_HEADER(chars);
+    interned->refcount--;
+    if (interned->refcount == 0) {
+        parson_free(interned);
+    }
+}
+
+/* Parser */
+static JSON_Status skip_quotes(const char **string) {
+    if (**string != '\"') {
+        return JSONFailure;
+    }
+    SKIP_CHAR(string);
+    while (**string != '\"') {
+        if (**string == '\0') {
+            return JSONFailure;
+        } else if (**string == '\\') {
+            SKIP_CHAR(string);
+            if (**string == '\0') {
+                return JSONFailure;
+            }
+        }
+        SKIP_CHAR(string);
+    }
+    SKIP_CHAR(string);
+    return JSONSuccess;
+}
+
+static JSON_Status parse_utf16(const char **unprocessed, char **processed) {
+    unsigned int cp, lead, trail;
+    char *processed_ptr = *processed;
+    const char *unprocessed_ptr = *unprocessed;
+    JSON_Status status = JSONFailure;
+    unprocessed_ptr++; /* skips u */
+    status = parse_utf16_hex(unprocessed_ptr, &cp);
+    if (status != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (cp < 0x80) {
+        processed_ptr[0] = (char)cp; /* 0xxxxxxx */
+    } else if (cp < 0x800) {
+        processed_ptr[0] = ((cp >> 6) & 0x1F) | 0xC0; /* 110xxxxx */
+        processed_ptr[1] = ((cp)      & 0x3F) | 0x80; /* 10xxxxxx */
+        processed_ptr += 1;
+    } else if (cp < 0xD800 || cp > 0xDFFF) {
+        processed_ptr[0] = ((cp >> 12) & 0x0F) | 0xE0; /* 1110xxxx */
+        processed_ptr[1] = ((cp >> 6)  & 0x3F) | 0x80; /* 10xxxxxx */
+        processed_ptr[2] = ((cp)       & 0x3F) | 0x80; /* 10xxxxxx */
+        processed_ptr += 2;
+    } else if (cp >= 0xD800 && cp <= 0xDBFF) { /* lead surrogate (0xD800..0xDBFF) */
+        lead = cp;
+        unprocessed_ptr += 4; /* should always be within the buffer, otherwise previous sscanf would fail */
+        if (*unprocessed_ptr++ != '\\' || *unprocessed_ptr++ != 'u') {
             return JSONFailure;
         }
         status = parse_utf16_hex(unprocessed_ptr, &trail);
@@ -851,18 +2140,13 @@ static JSON_Status parse_utf16(const char **unprocessed, char **processed) {
 }
 
 
-/* Copies and processes passed string up to supplied length.
-Example: "\u006Corem ipsum" -> lorem ipsum */
-static char* process_string(const char *input, size_t input_len, size_t *output_len) {
+/* Processes passed string up to supplied length and writes it to output, which has to fit
+   at least input_len + 1 bytes (processed string is never longer than the input).
+Input is the text between the quotes, escapes are decoded.
+Example: \u006Corem \"ipsum\" -> lorem "ipsum" */
+static JSON_Status process_string_into(const char *input, size_t input_len, char *output, size_t *output_len) {
     const char *input_ptr = input;
-    size_t initial_size = (input_len + 1) * sizeof(char);
-    size_t final_size = 0;
-    char *output = NULL, *output_ptr = NULL, *resized_output = NULL;
-    output = (char*)parson_malloc(initial_size);
-    if (output == NULL) {
-        goto error;
-    }
-    output_ptr = output;
+    char *output_ptr = output;
     while ((*input_ptr != '\0') && (size_t)(input_ptr - input) < input_len) {
         if (*input_ptr == '\\') {
             input_ptr++;
@@ -877,14 +2161,14 @@ static char* process_string(const char *input, size_t input_len, size_t *output_
                 case 't':  *output_ptr = '\t'; break;
                 case 'u':
                     if (parse_utf16(&input_ptr, &output_ptr) != JSONSuccess) {
-                        goto error;
+                        return JSONFailure;
                     }
                     break;
                 default:
-                    goto error;
+                    return JSONFailure;
             }
         } else if ((unsigned char)*input_ptr < 0x20) {
-            goto error; /* 0x00-0x19 are invalid characters for json string (http://www.ietf.org/rfc/rfc4627.txt) */
+            return JSONFailure; /* 0x00-0x19 are invalid characters for json string (http://www.ietf.org/rfc/rfc4627.txt) */
         } else {
             *output_ptr = *input_ptr;
         }
@@ -892,16 +2176,31 @@ static char* process_string(const char *input, size_t input_len, size_t *output_
         input_ptr++;
     }
     *output_ptr = '\0';
-    /* resize to new length */
-    final_size = (size_t)(output_ptr-output) + 1;
-    /* todo: don't resize if final_size == initial_size */
-    resized_output = (char*)parson_malloc(final_size);
-    if (resized_output == NULL) {
+    *output_len = (size_t)(output_ptr - output);
+    return JSONSuccess;
+}
+
+/* Copies and processes passed string up to supplied length. */
+static char* process_string(const char *input, size_t input_len, size_t *output_len) {
+    size_t initial_size = (input_len + 1) * sizeof(char);
+    size_t final_size = 0;
+    char *output = NULL, *resized_output = NULL;
+    output = (char*)parson_malloc(initial_size);
+    if (output == NULL) {
         goto error;
     }
-    memcpy(resized_output, output, final_size);
-    *output_len = final_size - 1;
-    parson_free(output);
+    if (process_string_into(input, input_len, output, output_len) != JSONSuccess) {
+        goto error;
+    }
+    /* shrink to new length, escapes make output shorter than input */
+    final_size = *output_len + 1;
+    if (final_size == initial_size) {
+        return output;
+    }
+    resized_output = (char*)parson_realloc(output, initial_size, final_size);
+    if (resized_output == NULL) {
+        return output; /* failing to shrink is harmless */
+    }
     return resized_output;
 error:
     parson_free(output);
@@ -921,18 +2220,23 @@ static char * get_quoted_string(const char **string, size_t *output_string_len)
     return process_string(string_start + 1, input_string_len, output_string_len);
 }
 
-static JSON_Value * parse_value(const char **string, size_t nesting) {
+static JSON_Value * parse_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns) {
+    const char *start = NULL;
+    JSON_Value *value = NULL;
     if (nesting > MAX_NESTING) {
         return NULL;
     }
     SKIP_WHITESPACES(string);
+    start = *string;
     switch (**string) {
         case '{':
-            return parse_object_value(string, nesting + 1);
+            value = parse_object_value(string, nesting + 1, options, source, interns);
+            break;
         case '[':
-            return parse_array_value(string, nesting + 1);
+            value = parse_array_value(string, nesting + 1, options, source, interns);
+            break;
         case '\"':
-            return parse_string_value(string);
+            return parse_string_value(string, interns);
         case 'f': case 't':
             return parse_boolean_value(string);
         case '-':
@@ -944,9 +2248,18 @@ static JSON_Value * parse_value(const char **string, size_t nesting) {
         default:
             return NULL;
     }
+#ifndef PARSON_COMPACT_VALUES
+    if (source != NULL) {
+        return json_value_set_source(value, source, start, *string);
+    }
+#else
+    (void)source;
+    (void)start;
+#endif
+    return value;
 }
 
-static JSON_Value * parse_object_value(const char **string, size_t nesting) {
+static JSON_Value * parse_object_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns) {
     JSON_Status status = JSONFailure;
     JSON_Value *output_value = NULL, *new_value = NULL;
     JSON_Object *output_object = NULL;
@@ -987,7 +2300,7 @@ static JSON_Value * parse_object_value(const char **string, size_t nesting) {
             return NULL;
         }
         SKIP_CHAR(string);
-        new_value = parse_value(string, nesting);
+        new_value = parse_value(string, nesting, options, source, interns);
         if (new_value == NULL) {
             parson_free(new_key);
             json_value_free(output_value);
@@ -1019,7 +2332,7 @@ static JSON_Value * parse_object_value(const char **string, size_t nesting) {
     return output_value;
 }
 
-static JSON_Value * parse_array_value(const char **string, size_t nesting) {
+static JSON_Value * parse_array_value(const char **string, size_t nesting, const JSON_Parse_Options *options, JSON_Source *source, JSON_Intern_Table *interns) {
     JSON_Value *output_value = NULL, *new_array_value = NULL;
     JSON_Array *output_array = NULL;
     output_value = json_value_init_array();
@@ -1038,7 +2351,10 @@ static JSON_Value * parse_array_value(const char **string, size_t nesting) {
         return output_value;
     }
     while (**string != '\0') {
-        new_array_value = parse_value(string, nesting);
+        if (options->pack_arrays && parse_packed_array_item(string, output_array) == JSONSuccess) {
+            goto next_item;
+        }
+        new_array_value = parse_value(string, nesting, options, source, interns);
         if (new_array_value == NULL) {
             json_value_free(output_value);
             return NULL;
@@ -1048,6 +2364,7 @@ static JSON_Value * parse_array_value(const char **string, size_t nesting) {
             json_value_free(output_value);
             return NULL;
         }
+next_item:
         SKIP_WHITESPACES(string);
         if (**string != ',') {
             break;
@@ -1064,14 +2381,58 @@ static JSON_Value * parse_array_value(const char **string, size_t nesting) {
             json_value_free(output_value);
             return NULL;
     }
-    SKIP_CHAR(string);
-    return output_value;
-}
-
-static JSON_Value * parse_string_value(const char **string) {
-    JSON_Value *value = NULL;
-    size_t new_string_len = 0;
-    char *new_string = get_quoted_string(string, &new_string_len);
+    SKIP_CHAR(string);
+    return output_value;
+}
+
+/* Adds a number or boolean to a packed (or still empty) array without creating a value.
+   Fails without consuming input if the item doesn't fit, then it's parsed normally. */
+static JSON_Status parse_packed_array_item(const char **string, JSON_Array *array) {
+    const char *item_start = *string;
+    double number = 0;
+    int boolean = 0;
+    if (array->count > 0 && array->packing == ARRAY_BOXED) {
+        return JSONFailure;
+    }
+    if ((**string == 't' || **string == 'f')
+        && (array->count == 0 || array->packing == ARRAY_PACKED_BOOLEANS)) {
+        if (parse_boolean(string, &boolean) == JSONSuccess
+            && json_array_add_boolean(array, boolean) == JSONSuccess) {
+            return JSONSuccess;
+        }
+    } else if ((**string == '-' || (**string >= '0' && **string <= '9'))
+               && (array->count == 0 || array->packing == ARRAY_PACKED_NUMBERS)) {
+        if (parse_number(string, &number) == JSONSuccess
+            && json_array_add_number(array, number) == JSONSuccess) {
+            return JSONSuccess;
+        }
+    }
+    *string = item_start;
+    return JSONFailure;
+}
+
+static JSON_Value * parse_string_value(const char **string, JSON_Intern_Table *interns) {
+    JSON_Value *value = NULL;
+    const char *string_start = *string;
+    size_t input_string_len = 0;
+    size_t new_string_len = 0;
+    char short_string[PARSON_INTERN_MAX_LEN + 1];
+    char *new_string = NULL;
+    if (skip_quotes(string) != JSONSuccess) {
+        return NULL;
+    }
+    input_string_len = *string - string_start - 2; /* length without quotes */
+    if (input_string_len <= SHORT_STRING_MAX_LEN || (interns != NULL && input_string_len <= PARSON_INTERN_MAX_LEN)) {
+        /* processed string is never longer than the input, so it's going to fit */
+        if (process_string_into(string_start + 1, input_string_len, short_string, &new_string_len) != JSONSuccess) {
+            return NULL;
+        }
+        if (new_string_len <= SHORT_STRING_MAX_LEN) {
+            return json_value_init_short_string(short_string, new_string_len);
+        }
+        return json_value_init_interned_string(interns, short_string, new_string_len);
+    }
+    new_string = process_string(string_start + 1, input_string_len, &new_string_len);
     if (new_string == NULL) {
         return NULL;
     }
@@ -1083,31 +2444,48 @@ static JSON_Value * parse_string_value(const char **string) {
     return value;
 }
 
-static JSON_Value * parse_boolean_value(const char **string) {
+static JSON_Status parse_boolean(const char **string, int *boolean) {
     size_t true_token_size = SIZEOF_TOKEN("true");
     size_t false_token_size = SIZEOF_TOKEN("false");
     if (strncmp("true", *string, true_token_size) == 0) {
         *string += true_token_size;
-        return json_value_init_boolean(1);
+        *boolean = 1;
+        return JSONSuccess;
     } else if (strncmp("false", *string, false_token_size) == 0) {
         *string += false_token_size;
-        return json_value_init_boolean(0);
+        *boolean = 0;
+        return JSONSuccess;
     }
-    return NULL;
+    return JSONFailure;
 }
 
-static JSON_Value * parse_number_value(const char **string) {
+static JSON_Value * parse_boolean_value(const char **string) {
+    int boolean = 0;
+    if (parse_boolean(string, &boolean) != JSONSuccess) {
+        return NULL;
+    }
+    return json_value_init_boolean(boolean);
+}
+
+static JSON_Status parse_number(const char **string, double *number) {
     char *end;
-    double number = 0;
     errno = 0;
-    number = strtod(*string, &end);
-    if (errno == ERANGE && (number <= -HUGE_VAL || number >= HUGE_VAL)) {
-        return NULL;
+    *number = strtod(*string, &end);
+    if (errno == ERANGE && (*number <= -HUGE_VAL || *number >= HUGE_VAL)) {
+        return JSONFailure;
     }
     if ((errno && errno != ERANGE) || !is_decimal(*string, end - *string)) {
-        return NULL;
+        return JSONFailure;
     }
     *string = end;
+    return JSONSuccess;
+}
+
+static JSON_Value * parse_number_value(const char **string) {
+    double number = 0;
+    if (parse_number(string, &number) != JSONSuccess) {
+        return NULL;
+    }
     return json_value_init_number(number);
 }
 
@@ -1122,286 +2500,919 @@ static JSON_Value * parse_null_value(const char **string) {
 
 /* Serialization */
 
-/*  APPEND_STRING() is only called on string literals.
-    It's a bit hacky because it makes plenty of assumptions about the external state
-    and should eventually be tidied up into a function (same goes for APPEND_INDENT)
- */
-#define APPEND_STRING(str) do {\
-                                written = SIZEOF_TOKEN((str));\
-                                if (buf != NULL) {\
-                                    memcpy(buf, (str), written);\
-                                    buf[written] = '\0';\
-                                    buf += written;\
-                                }\
-                                written_total += written;\
-                            } while (0)
-
-#define APPEND_INDENT(level) do {\
-                                int level_i = 0;\
-                                for (level_i = 0; level_i < (level); level_i++) {\
-                                    APPEND_STRING(PARSON_INDENT_STR);\
-                                }\
-                            } while (0)
-
-static int json_serialize_to_buffer_r(const JSON_Value *value, char *buf, int level, parson_bool_t is_pretty, char *num_buf)
-{
+/* Plain json_serialize_* functions use global settings, _ex variants only read passed options. */
+static void json_serialize_options_from_globals(JSON_Serialize_Options *options, parson_bool_t is_pretty) {
+    json_serialize_options_init(options);
+    options->pretty = is_pretty;
+    options->escape_slashes = parson_escape_slashes;
+    options->float_format = parson_float_format;
+    options->number_serialization_function = parson_number_serialization_function;
+}
+
+static void writer_init(JSON_Writer *writer, int mode, char *buf, size_t capacity) {
+    writer->mode = mode;
+    writer->buf = buf;
+    writer->len = 0;
+    writer->capacity = capacity;
+    writer->failed = PARSON_FALSE;
+    writer->uncached = PARSON_FALSE;
+    writer->write_fun = NULL;
+    writer->write_ctx = NULL;
+    writer->indent = PARSON_INDENT_STR;
+    writer->indent_len = SIZEOF_TOKEN(PARSON_INDENT_STR);
+    writer->indent_run = NULL;
+    writer->newline = "\n";
+    writer->newline_len = 1;
+    writer->refs = NULL;
+    writer->ref_count = 0;
+    writer->ref_capacity = 0;
+}
+
+/* Makes room for len more bytes and a terminating null character */
+static JSON_Status writer_grow(JSON_Writer *writer, size_t len) {
+    size_t new_capacity = MAX(writer->capacity, 256);
+    char *new_buf = NULL;
+    if (len > (size_t)-1 - 1 - writer->len) {
+        return JSONFailure;
+    }
+    while (new_capacity < writer->len + len + 1) {
+        if (new_capacity > (size_t)-1 / 2) {
+            new_capacity = writer->len + len + 1;
+            break;
+        }
+        new_capacity *= 2;
+    }
+    new_buf = (char*)parson_realloc(writer->buf, writer->capacity, new_capacity);
+    if (new_buf == NULL) {
+        return JSONFailure;
+    }
+    writer->buf = new_buf;
+    writer->capacity = new_capacity;
+    return JSONSuccess;
+}
+
+static parson_bool_t writer_has_room(JSON_Writer *writer, size_t len) {
+    if (writer->failed || writer->mode == WRITER_COUNT) {
+        return PARSON_FALSE;
+    }
+    if (len < writer->capacity && writer->len < writer->capacity - len) {
+        return PARSON_TRUE; /* len bytes and a null character fit */
+    }
+    if (writer->mode == WRITER_STREAM) {
+        writer_flush(writer);
+        return !writer->failed && len < writer->capacity;
+    }
+    if (writer->mode == WRITER_FIXED || writer_grow(writer, len) != JSONSuccess) {
+        writer->failed = PARSON_TRUE;
+        return PARSON_FALSE;
+    }
+    return PARSON_TRUE;
+}
+
+static void writer_flush(JSON_Writer *writer) {
+    if (writer->mode != WRITER_STREAM || writer->failed || writer->len == 0) {
+        return;
+    }
+    if (writer->write_fun(writer->write_ctx, writer->buf, writer->len) != JSONSuccess) {
+        writer->failed = PARSON_TRUE;
+    }
+    writer->len = 0;
+}
+
+static void writer_write(JSON_Writer *writer, const char *data, size_t len) {
+    if (writer->mode == WRITER_COUNT) {
+        if (len > (size_t)-1 - 1 - writer->len) {
+            writer->failed = PARSON_TRUE; /* size with a null character doesn't fit in size_t */
+            return;
+        }
+        writer->len += len;
+        return;
+    }
+    if (!writer_has_room(writer, len)) {
+        if (writer->mode == WRITER_STREAM && !writer->failed
+            && writer->write_fun(writer->write_ctx, data, len) != JSONSuccess) {
+            writer->failed = PARSON_TRUE; /* too long for the buffer, written directly */
+        }
+        return;
+    }
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+/* Writes characters of a string that will stay in place while output is used,
+   WRITER_IOVEC references long runs instead of copying them. */
+static void writer_write_run(JSON_Writer *writer, const char *data, size_t len) {
+    JSON_Writer_Ref *new_refs = NULL;
+    size_t new_capacity = 0;
+    if (writer->mode != WRITER_IOVEC || len < PARSON_IOVEC_MIN_REF_SIZE || writer->failed) {
+        writer_write(writer, data, len);
+        return;
+    }
+    if (writer->ref_count >= writer->ref_capacity) {
+        new_capacity = MAX(writer->ref_capacity * 2, STARTING_CAPACITY);
+        new_refs = (JSON_Writer_Ref*)parson_realloc(writer->refs, writer->ref_capacity * sizeof(JSON_Writer_Ref),
+                                                    new_capacity * sizeof(JSON_Writer_Ref));
+        if (new_refs == NULL) {
+            writer->failed = PARSON_TRUE;
+            return;
+        }
+        writer->refs = new_refs;
+        writer->ref_capacity = new_capacity;
+    }
+    writer->refs[writer->ref_count].offset = writer->len;
+    writer->refs[writer->ref_count].data = data;
+    writer->refs[writer->ref_count].len = len;
+    writer->ref_count++;
+}
+
+/* Returns space for len (at most PARSON_NUM_BUF_SIZE) bytes that are written
+   directly into the output and then passed to writer_commit. */
+static char * writer_reserve(JSON_Writer *writer, size_t len) {
+    if (writer->mode == WRITER_FIXED && (len >= writer->capacity || writer->len >= writer->capacity - len)) {
+        return writer->scratch; /* may still fit once formatted, checked in writer_commit */
+    }
+    if (writer->mode == WRITER_COUNT || !writer_has_room(writer, len)) {
+        return writer->scratch;
+    }
+    return writer->buf + writer->len;
+}
+
+static void writer_commit(JSON_Writer *writer, const char *data, size_t len) {
+    if (data == writer->scratch) {
+        writer_write(writer, data, len);
+    } else {
+        writer->len += len;
+    }
+}
+
+static void writer_set_layout(JSON_Writer *writer, const JSON_Serialize_Options *options) {
+    size_t i = 0;
+    if (options->indent) {
+        writer->indent = options->indent;
+        writer->indent_len = strlen(options->indent);
+    }
+    if (options->newline) {
+        writer->newline = options->newline;
+        writer->newline_len = strlen(options->newline);
+    }
+    writer->indent_run = NULL;
+    if (writer->indent_len == 0) {
+        return;
+    }
+    i = 1;
+    while (i < writer->indent_len && writer->indent[i] == writer->indent[0]) {
+        i++;
+    }
+    if (i == writer->indent_len && writer->indent[0] == ' ') {
+        writer->indent_run = parson_space_run;
+    } else if (i == writer->indent_len && writer->indent[0] == '\t') {
+        writer->indent_run = parson_tab_run;
+    }
+}
+
+static void writer_write_indent(JSON_Writer *writer, int level) {
+    size_t len = 0, chunk = 0;
+    int i = 0;
+    if (writer->indent_run == NULL) {
+        for (i = 0; i < level; i++) {
+            writer_write(writer, writer->indent, writer->indent_len);
+        }
+        return;
+    }
+    len = (size_t)level * writer->indent_len;
+    while (len > 0) {
+        chunk = len < SIZEOF_TOKEN(parson_space_run) ? len : SIZEOF_TOKEN(parson_space_run);
+        writer_write(writer, writer->indent_run, chunk);
+        len -= chunk;
+    }
+}
+
+/* Serializes value once, errors in writer (full fixed buffer, failed allocation)
+   are checked by the caller. cache_mode is one of SERIALIZE_CACHE_*. */
+static JSON_Status json_serialize_to_writer_r(const JSON_Value *value, JSON_Writer *writer, int level, const JSON_Serialize_Options *options, int cache_mode) {
+    parson_bool_t is_pretty = options->pretty && !options->canonical ? PARSON_TRUE : PARSON_FALSE;
+    parson_bool_t escape_slashes = options->escape_slashes && !options->canonical ? PARSON_TRUE : PARSON_FALSE;
     const char *key = NULL, *string = NULL;
-    JSON_Value *temp_value = NULL;
     JSON_Array *array = NULL;
     JSON_Object *object = NULL;
-    size_t i = 0, count = 0;
-    double num = 0.0;
-    int written = -1, written_total = 0;
-    size_t len = 0;
-
+    char **sorted_names_buf[PARSON_SORT_BUF_SIZE];
+    char ***sorted_names = NULL;
+    size_t i = 0, ix = 0, count = 0;
+    int child_cache_mode = SERIALIZE_CACHE_NONE;
+    JSON_Status status = JSONSuccess;
+
+    if (cache_mode == SERIALIZE_CACHE_USE || cache_mode == SERIALIZE_CACHE_FILL) {
+        child_cache_mode = SERIALIZE_CACHE_USE;
+    }
+#ifndef PARSON_COMPACT_VALUES
+    if ((cache_mode == SERIALIZE_CACHE_NONE || cache_mode == SERIALIZE_CACHE_USE) && value != NULL
+        && (value->type == JSONObject || value->type == JSONArray)
+        && (cache_mode == SERIALIZE_CACHE_USE || (value->flags & VALUE_FLAG_CACHE_OUTPUT)
+            || ((JSON_Container_Value*)value)->cache != NULL)
+        && options->float_format == NULL && options->number_serialization_function == NULL && !options->canonical
+        && (!options->pretty || (options->indent == NULL && options->newline == NULL))) {
+        return json_serialize_cached(value, writer, level, options, cache_mode);
+    }
+#endif
     switch (json_value_get_type(value)) {
         case JSONArray:
             array = json_value_get_array(value);
             count = json_array_get_count(array);
-            APPEND_STRING("[");
+            writer_write(writer, "[", 1);
             if (count > 0 && is_pretty) {
-                APPEND_STRING("\n");
+                writer_write(writer, writer->newline, writer->newline_len);
             }
-            for (i = 0; i < count; i++) {
+            for (i = 0; i < count && !writer->failed; i++) {
                 if (is_pretty) {
-                    APPEND_INDENT(level+1);
+                    writer_write_indent(writer, level + 1);
                 }
-                temp_value = json_array_get_value(array, i);
-                written = json_serialize_to_buffer_r(temp_value, buf, level+1, is_pretty, num_buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
+                if (array->packing == ARRAY_PACKED_NUMBERS) {
+                    json_serialize_number(ARRAY_NUMBERS(array)[i], writer, options);
+                } else if (array->packing == ARRAY_PACKED_BOOLEANS) {
+                    if (ARRAY_GET_BIT(array, i)) {
+                        writer_write(writer, "true", 4);
+                    } else {
+                        writer_write(writer, "false", 5);
+                    }
+                } else if (json_serialize_to_writer_r(array->items[i], writer, level + 1, options, child_cache_mode) != JSONSuccess) {
+                    return JSONFailure;
                 }
-                written_total += written;
                 if (i < (count - 1)) {
-                    APPEND_STRING(",");
+                    writer_write(writer, ",", 1);
                 }
                 if (is_pretty) {
-                    APPEND_STRING("\n");
+                    writer_write(writer, writer->newline, writer->newline_len);
                 }
             }
             if (count > 0 && is_pretty) {
-                APPEND_INDENT(level);
+                writer_write_indent(writer, level);
             }
-            APPEND_STRING("]");
-            return written_total;
+            writer_write(writer, "]", 1);
+            return JSONSuccess;
         case JSONObject:
             object = json_value_get_object(value);
             count  = json_object_get_count(object);
-            APPEND_STRING("{");
+            if (options->canonical && count > 1) {
+                /* sorts pointers to the names' slots, so positions of names (and values) stay known */
+                sorted_names = count <= PARSON_SORT_BUF_SIZE ? sorted_names_buf
+                                                             : (char***)parson_malloc(count * sizeof(char**));
+                if (sorted_names == NULL) {
+                    return JSONFailure;
+                }
+                for (i = 0; i < count; i++) {
+                    sorted_names[i] = &object->names[i];
+                }
+                qsort(sorted_names, count, sizeof(char**), compare_names_utf16);
+            }
+            writer_write(writer, "{", 1);
             if (count > 0 && is_pretty) {
-                APPEND_STRING("\n");
+                writer_write(writer, writer->newline, writer->newline_len);
             }
-            for (i = 0; i < count; i++) {
-                key = json_object_get_name(object, i);
+            for (i = 0; i < count && !writer->failed && status == JSONSuccess; i++) {
+                ix = sorted_names ? (size_t)(sorted_names[i] - object->names) : i;
+                key = json_object_get_name(object, ix);
                 if (key == NULL) {
-                    return -1;
+                    status = JSONFailure;
+                    break;
                 }
                 if (is_pretty) {
-                    APPEND_INDENT(level+1);
+                    writer_write_indent(writer, level + 1);
                 }
                 /* We do not support key names with embedded \0 chars */
-                written = json_serialize_string(key, strlen(key), buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
-                }
-                written_total += written;
-                APPEND_STRING(":");
+                json_serialize_string(key, strlen(key), writer, escape_slashes);
+                writer_write(writer, ":", 1);
                 if (is_pretty) {
-                    APPEND_STRING(" ");
+                    writer_write(writer, " ", 1);
                 }
-                temp_value = json_object_get_value_at(object, i);
-                written = json_serialize_to_buffer_r(temp_value, buf, level+1, is_pretty, num_buf);
-                if (written < 0) {
-                    return -1;
-                }
-                if (buf != NULL) {
-                    buf += written;
-                }
-                written_total += written;
+                status = json_serialize_to_writer_r(object->values[ix], writer, level + 1, options, child_cache_mode);
                 if (i < (count - 1)) {
-                    APPEND_STRING(",");
+                    writer_write(writer, ",", 1);
                 }
                 if (is_pretty) {
-                    APPEND_STRING("\n");
+                    writer_write(writer, writer->newline, writer->newline_len);
                 }
             }
+            if (sorted_names != sorted_names_buf) {
+                parson_free(sorted_names);
+            }
             if (count > 0 && is_pretty) {
-                APPEND_INDENT(level);
+                writer_write_indent(writer, level);
             }
-            APPEND_STRING("}");
-            return written_total;
+            writer_write(writer, "}", 1);
+            return status;
         case JSONString:
             string = json_value_get_string(value);
             if (string == NULL) {
-                return -1;
-            }
-            len = json_value_get_string_len(value);
-            written = json_serialize_string(string, len, buf);
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
+                return JSONFailure;
             }
-            written_total += written;
-            return written_total;
+            json_serialize_string(string, json_value_get_string_len(value), writer, escape_slashes);
+            return JSONSuccess;
         case JSONBoolean:
             if (json_value_get_boolean(value)) {
-                APPEND_STRING("true");
+                writer_write(writer, "true", 4);
             } else {
-                APPEND_STRING("false");
+                writer_write(writer, "false", 5);
             }
-            return written_total;
+            return JSONSuccess;
         case JSONNumber:
-            num = json_value_get_number(value);
-            if (buf != NULL) {
-                num_buf = buf;
-            }
-            if (parson_number_serialization_function) {
-                written = parson_number_serialization_function(num, num_buf);
-            } else {
-                const char *float_format = parson_float_format ? parson_float_format : PARSON_DEFAULT_FLOAT_FORMAT;
-                written = parson_sprintf(num_buf, float_format, num);
-            }
-            if (written < 0) {
-                return -1;
-            }
-            if (buf != NULL) {
-                buf += written;
-            }
-            written_total += written;
-            return written_total;
+            json_serialize_number(json_value_get_number(value), writer, options);
+            return JSONSuccess;
         case JSONNull:
-            APPEND_STRING("null");
-            return written_total;
+            writer_write(writer, "null", 4);
+            return JSONSuccess;
         case JSONError:
-            return -1;
+            return JSONFailure;
         default:
-            return -1;
+            return JSONFailure;
     }
 }
 
-static int json_serialize_string(const char *string, size_t len, char *buf) {
-    size_t i = 0;
-    char c = '\0';
-    int written = -1, written_total = 0;
-    APPEND_STRING("\"");
-    for (i = 0; i < len; i++) {
-        c = string[i];
-        switch (c) {
-            case '\"': APPEND_STRING("\\\""); break;
-            case '\\': APPEND_STRING("\\\\"); break;
-            case '\b': APPEND_STRING("\\b"); break;
-            case '\f': APPEND_STRING("\\f"); break;
-            case '\n': APPEND_STRING("\\n"); break;
-            case '\r': APPEND_STRING("\\r"); break;
-            case '\t': APPEND_STRING("\\t"); break;
-            case '\x00': APPEND_STRING("\\u0000"); break;
-            case '\x01': APPEND_STRING("\\u0001"); break;
-            case '\x02': APPEND_STRING("\\u0002"); break;
-            case '\x03': APPEND_STRING("\\u0003"); break;
-            case '\x04': APPEND_STRING("\\u0004"); break;
-            case '\x05': APPEND_STRING("\\u0005"); break;
-            case '\x06': APPEND_STRING("\\u0006"); break;
-            case '\x07': APPEND_STRING("\\u0007"); break;
-            /* '\x08' duplicate: '\b' */
-            /* '\x09' duplicate: '\t' */
-            /* '\x0a' duplicate: '\n' */
-            case '\x0b': APPEND_STRING("\\u000b"); break;
-            /* '\x0c' duplicate: '\f' */
-            /* '\x0d' duplicate: '\r' */
-            case '\x0e': APPEND_STRING("\\u000e"); break;
-            case '\x0f': APPEND_STRING("\\u000f"); break;
-            case '\x10': APPEND_STRING("\\u0010"); break;
-            case '\x11': APPEND_STRING("\\u0011"); break;
-            case '\x12': APPEND_STRING("\\u0012"); break;
-            case '\x13': APPEND_STRING("\\u0013"); break;
-            case '\x14': APPEND_STRING("\\u0014"); break;
-            case '\x15': APPEND_STRING("\\u0015"); break;
-            case '\x16': APPEND_STRING("\\u0016"); break;
-            case '\x17': APPEND_STRING("\\u0017"); break;
-            case '\x18': APPEND_STRING("\\u0018"); break;
-            case '\x19': APPEND_STRING("\\u0019"); break;
-            case '\x1a': APPEND_STRING("\\u001a"); break;
-            case '\x1b': APPEND_STRING("\\u001b"); break;
-            case '\x1c': APPEND_STRING("\\u001c"); break;
-            case '\x1d': APPEND_STRING("\\u001d"); break;
-            case '\x1e': APPEND_STRING("\\u001e"); break;
-            case '\x1f': APPEND_STRING("\\u001f"); break;
-            case '/':
-                if (parson_escape_slashes) {
-                    APPEND_STRING("\\/");  /* to make json embeddable in xml\/html */
-                } else {
-                    APPEND_STRING("/");
+#ifndef PARSON_COMPACT_VALUES
+/* Writes cached output (or source text) of a container, or serializes it and fills the cache
+   if caching is enabled for it. A cache is valid only if every container inside it stored its own
+   cache (so changing one of them invalidates it), otherwise writer's uncached is set for the parent. */
+static JSON_Status json_serialize_cached(const JSON_Value *value, JSON_Writer *writer, int level, const JSON_Serialize_Options *options, int cache_mode) {
+    JSON_Serialization_Cache *cache = ((JSON_Container_Value*)value)->cache;
+    unsigned char format = (unsigned char)((options->pretty ? CACHE_FORMAT_PRETTY : 0)
+                                           | (options->escape_slashes ? CACHE_FORMAT_ESCAPE_SLASHES : 0));
+    JSON_Writer temp_writer;
+    JSON_Writer *target = writer;
+    parson_bool_t uncached = writer->uncached;
+    size_t start = 0, len = 0;
+    char *data = NULL;
+    if (cache && cache->valid
+        && ((cache->level == level && cache->format == format) || (cache->source && !options->pretty))) {
+        if (cache->source) {
+            writer_write_run(writer, cache->data, cache->len); /* source text stays while value is unchanged */
+        } else {
+            writer_write(writer, cache->data, cache->len);
+        }
+        return JSONSuccess;
+    }
+    if (cache_mode != SERIALIZE_CACHE_USE && !(value->flags & VALUE_FLAG_CACHE_OUTPUT)) {
+        return json_serialize_to_writer_r(value, writer, level, options, SERIALIZE_CACHE_SKIP);
+    }
+    if (cache == NULL) {
+        cache = (JSON_Serialization_Cache*)parson_malloc(sizeof(JSON_Serialization_Cache));
+        if (cache == NULL) {
+            writer->uncached = PARSON_TRUE;
+            return json_serialize_to_writer_r(value, writer, level, options, SERIALIZE_CACHE_FILL);
+        }
+        memset(cache, 0, sizeof(JSON_Serialization_Cache));
+        ((JSON_Container_Value*)value)->cache = cache;
+    }
+    cache->valid = PARSON_FALSE;
+    if (cache->source) {
+        json_cache_release_data(cache);
+    }
+    /* output is captured from the writer's buffer if it has one, otherwise from a temporary one */
+    if (writer->mode == WRITER_FIXED || writer->mode == WRITER_GROWABLE) {
+        start = writer->len;
+    } else {
+        writer_init(&temp_writer, WRITER_GROWABLE, NULL, 0);
+        writer_set_layout(&temp_writer, options);
+        target = &temp_writer;
+    }
+    target->uncached = PARSON_FALSE;
+    if (json_serialize_to_writer_r(value, target, level, options, SERIALIZE_CACHE_FILL) != JSONSuccess) {
+        if (target == &temp_writer) {
+            parson_free(temp_writer.buf);
+        }
+        writer->uncached = PARSON_TRUE;
+        return JSONFailure;
+    }
+    if (!target->failed && !target->uncached) {
+        len = target->len - start;
+        if (len > cache->capacity) {
+            data = (char*)parson_malloc(len);
+            if (data) {
+                parson_free(cache->data);
+                cache->data = data;
+                cache->capacity = len;
+            }
+        }
+        if (len <= cache->capacity) {
+            memcpy(cache->data, target->buf + start, len);
+            cache->len = len;
+            cache->level = level;
+            cache->format = format;
+            cache->valid = PARSON_TRUE;
+        }
+    }
+    writer->uncached = uncached || !cache->valid;
+    if (target == &temp_writer) {
+        if (temp_writer.failed) {
+            writer->failed = PARSON_TRUE;
+        } else {
+            writer_write(writer, temp_writer.buf, temp_writer.len);
+        }
+        parson_free(temp_writer.buf);
+    }
+    return JSONSuccess;
+}
+#endif
+
+#ifdef PARSON_SHORTEST_NUMBERS
+/* Shortest formatting of doubles with Grisu3 (Florian Loitsch, "Printing Floating-Point Numbers
+   Quickly and Accurately with Integers"). Digits are generated from the scaled boundaries of the
+   double's rounding interval, widened by the error of the scaling. When that error leaves it unsure
+   whether the digits are the shortest and closest ones (about 0.5% of doubles), they're found with
+   printf and strtod instead, so the output is always the same as ECMAScript's and other exact
+   shortest formatting. */
+
+/* Normalized significands (f) and binary exponents (e) of 10^k for k = -348, -340, ..., 340 */
+static const struct {
+    unsigned long hi;
+    unsigned long lo;
+    int           e;
+} parson_cached_powers[] = {
+    { 0xfa8fd5a0UL, 0x081c0288UL, -1220 }, { 0xbaaee17fUL, 0xa23ebf76UL, -1193 }, { 0x8b16fb20UL, 0x3055ac76UL, -1166 },
+    { 0xcf42894aUL, 0x5dce35eaUL, -1140 }, { 0x9a6bb0aaUL, 0x55653b2dUL, -1113 }, { 0xe61acf03UL, 0x3d1a45dfUL, -1087 },
+    { 0xab70fe17UL, 0xc79ac6caUL, -1060 }, { 0xff77b1fcUL, 0xbebcdc4fUL, -1034 }, { 0xbe5691efUL, 0x416bd60cUL, -1007 },
+    { 0x8dd01fadUL, 0x907ffc3cUL, -980 }, { 0xd3515c28UL, 0x31559a83UL, -954 }, { 0x9d71ac8fUL, 0xada6c9b5UL, -927 },
+    { 0xea9c2277UL, 0x23ee8bcbUL, -901 }, { 0xaecc4991UL, 0x4078536dUL, -874 }, { 0x823c1279UL, 0x5db6ce57UL, -847 },
+    { 0xc2109436UL, 0x4dfb5637UL, -821 }, { 0x9096ea6fUL, 0x3848984fUL, -794 }, { 0xd77485cbUL, 0x25823ac7UL, -768 },
+    { 0xa086cfcdUL, 0x97bf97f4UL, -741 }, { 0xef340a98UL, 0x172aace5UL, -715 }, { 0xb23867fbUL, 0x2a35b28eUL, -688 },
+    { 0x84c8d4dfUL, 0xd2c63f3bUL, -661 }, { 0xc5dd4427UL, 0x1ad3cdbaUL, -635 }, { 0x936b9fceUL, 0xbb25c996UL, -608 },
+    { 0xdbac6c24UL, 0x7d62a584UL, -582 }, { 0xa3ab6658UL, 0x0d5fdaf6UL, -555 }, { 0xf3e2f893UL, 0xdec3f126UL, -529 },
+    { 0xb5b5ada8UL, 0xaaff80b8UL, -502 }, { 0x87625f05UL, 0x6c7c4a8bUL, -475 }, { 0xc9bcff60UL, 0x34c13053UL, -449 },
+    { 0x964e858cUL, 0x91ba2655UL, -422 }, { 0xdff97724UL, 0x70297ebdUL, -396 }, { 0xa6dfbd9fUL, 0xb8e5b88fUL, -369 },
+    { 0xf8a95fcfUL, 0x88747d94UL, -343 }, { 0xb9447093UL, 0x8fa89bcfUL, -316 }, { 0x8a08f0f8UL, 0xbf0f156bUL, -289 },
+    { 0xcdb02555UL, 0x653131b6UL, -263 }, { 0x993fe2c6UL, 0xd07b7facUL, -236 }, { 0xe45c10c4UL, 0x2a2b3b06UL, -210 },
+    { 0xaa242499UL, 0x697392d3UL, -183 }, { 0xfd87b5f2UL, 0x8300ca0eUL, -157 }, { 0xbce50864UL, 0x92111aebUL, -130 },
+    { 0x8cbccc09UL, 0x6f5088ccUL, -103 }, { 0xd1b71758UL, 0xe219652cUL, -77 }, { 0x9c400000UL, 0x00000000UL, -50 },
+    { 0xe8d4a510UL, 0x00000000UL, -24 }, { 0xad78ebc5UL, 0xac620000UL, 3 }, { 0x813f3978UL, 0xf8940984UL, 30 },
+    { 0xc097ce7bUL, 0xc90715b3UL, 56 }, { 0x8f7e32ceUL, 0x7bea5c70UL, 83 }, { 0xd5d238a4UL, 0xabe98068UL, 109 },
+    { 0x9f4f2726UL, 0x179a2245UL, 136 }, { 0xed63a231UL, 0xd4c4fb27UL, 162 }, { 0xb0de6538UL, 0x8cc8ada8UL, 189 },
+    { 0x83c7088eUL, 0x1aab65dbUL, 216 }, { 0xc45d1df9UL, 0x42711d9aUL, 242 }, { 0x924d692cUL, 0xa61be758UL, 269 },
+    { 0xda01ee64UL, 0x1a708deaUL, 295 }, { 0xa26da399UL, 0x9aef774aUL, 322 }, { 0xf209787bUL, 0xb47d6b85UL, 348 },
+    { 0xb454e4a1UL, 0x79dd1877UL, 375 }, { 0x865b8692UL, 0x5b9bc5c2UL, 402 }, { 0xc83553c5UL, 0xc8965d3dUL, 428 },
+    { 0x952ab45cUL, 0xfa97a0b3UL, 455 }, { 0xde469fbdUL, 0x99a05fe3UL, 481 }, { 0xa59bc234UL, 0xdb398c25UL, 508 },
+    { 0xf6c69a72UL, 0xa3989f5cUL, 534 }, { 0xb7dcbf53UL, 0x54e9beceUL, 561 }, { 0x88fcf317UL, 0xf22241e2UL, 588 },
+    { 0xcc20ce9bUL, 0xd35c78a5UL, 614 }, { 0x98165af3UL, 0x7b2153dfUL, 641 }, { 0xe2a0b5dcUL, 0x971f303aUL, 667 },
+    { 0xa8d9d153UL, 0x5ce3b396UL, 694 }, { 0xfb9b7cd9UL, 0xa4a7443cUL, 720 }, { 0xbb764c4cUL, 0xa7a44410UL, 747 },
+    { 0x8bab8eefUL, 0xb6409c1aUL, 774 }, { 0xd01fef10UL, 0xa657842cUL, 800 }, { 0x9b10a4e5UL, 0xe9913129UL, 827 },
+    { 0xe7109bfbUL, 0xa19c0c9dUL, 853 }, { 0xac2820d9UL, 0x623bf429UL, 880 }, { 0x80444b5eUL, 0x7aa7cf85UL, 907 },
+    { 0xbf21e440UL, 0x03acdd2dUL, 933 }, { 0x8e679c2fUL, 0x5e44ff8fUL, 960 }, { 0xd433179dUL, 0x9c8cb841UL, 986 },
+    { 0x9e19db92UL, 0xb4e31ba9UL, 1013 }, { 0xeb96bf6eUL, 0xbadf77d9UL, 1039 }, { 0xaf87023bUL, 0x9bf0ee6bUL, 1066 }
+};
+
+static Diy_Fp diy_fp_multiply(Diy_Fp x, Diy_Fp y) {
+    const parson_u64_t mask = 0xFFFFFFFFUL;
+    parson_u64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+    parson_u64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    parson_u64_t tmp = (bd >> 32) + (ad & mask) + (bc & mask) + ((parson_u64_t)1 << 31); /* rounds */
+    Diy_Fp result;
+    result.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    result.e = x.e + y.e + 64;
+    return result;
+}
+
+static Diy_Fp diy_fp_normalize(Diy_Fp x) {
+    while (!(x.f & PARSON_U64(0x80000000UL, 0))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* Moves the last digit closer to w while it stays in the interval, returns false if the error
+   of the scaled values leaves it unsure which digits are closest or if they're in the interval. */
+static parson_bool_t grisu_round_weed(char *buf, int len, parson_u64_t distance_high_w, parson_u64_t unsafe_interval, parson_u64_t rest, parson_u64_t ten_kappa, parson_u64_t unit) {
+    parson_u64_t small_distance = distance_high_w - unit;
+    parson_u64_t big_distance = distance_high_w + unit;
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa
+           && (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa
+        && (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return PARSON_FALSE;
+    }
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+/* Returns number of digits, or -1 if they may not be the shortest and closest */
+static int grisu_digits(Diy_Fp low, Diy_Fp w, Diy_Fp high, char *buf, int *k) {
+    static const unsigned long pow10[] = {
+        1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL, 1000000000UL
+    };
+    const int shift = -w.e;
+    const parson_u64_t one = (parson_u64_t)1 << shift;
+    parson_u64_t unit = 1;
+    parson_u64_t too_high = high.f + unit;
+    parson_u64_t unsafe_interval = too_high - (low.f - unit);
+    unsigned long integrals = (unsigned long)(too_high >> shift); /* fits in 32 bits */
+    parson_u64_t fractionals = too_high & (one - 1);
+    parson_u64_t rest = 0;
+    unsigned long digit = 0;
+    int kappa = 0, len = 0;
+    while (kappa < 10 && integrals >= pow10[kappa]) {
+        kappa++;
+    }
+    while (kappa > 0) {
+        digit = integrals / pow10[kappa - 1];
+        integrals %= pow10[kappa - 1];
+        buf[len++] = (char)('0' + digit);
+        kappa--;
+        rest = ((parson_u64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            *k += kappa;
+            return grisu_round_weed(buf, len, too_high - w.f, unsafe_interval, rest,
+                                    (parson_u64_t)pow10[kappa] << shift, unit) ? len : -1;
+        }
+    }
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digit = (unsigned long)(fractionals >> shift);
+        buf[len++] = (char)('0' + digit);
+        fractionals &= one - 1;
+        kappa--;
+        if (fractionals < unsafe_interval) {
+            *k += kappa;
+            return grisu_round_weed(buf, len, (too_high - w.f) * unit, unsafe_interval, fractionals, one, unit) ? len : -1;
+        }
+    }
+}
+
+/* Writes digits of a positive, finite num to buf (without a null character),
+   num == digits * 10^k. Returns number of digits, or -1 if it's unsure they're the shortest. */
+static int grisu3(double num, char *buf, int *k) {
+    const parson_u64_t hidden_bit = PARSON_U64(0x00100000UL, 0);
+    parson_u64_t bits = 0;
+    Diy_Fp v, plus, minus, c_mk;
+    int biased_e = 0, cached_ix = 0;
+    double dk = 0.0;
+    memcpy(&bits, &num, sizeof(bits));
+    biased_e = (int)((bits >> 52) & 0x7FF);
+    v.f = bits & (hidden_bit - 1);
+    if (biased_e != 0) {
+        v.f += hidden_bit;
+        v.e = biased_e - 1075;
+    } else {
+        v.e = -1074; /* subnormal */
+    }
+    /* boundaries halfway to the neighbouring doubles, with the same exponent as normalized v */
+    plus.f = (v.f << 1) + 1;
+    plus.e = v.e - 1;
+    while (!(plus.f & (hidden_bit << 1))) {
+        plus.f <<= 1;
+        plus.e--;
+    }
+    plus.f <<= 10;
+    plus.e -= 10;
+    if (v.f == hidden_bit && biased_e > 1) { /* lower neighbour is closer */
+        minus.f = (v.f << 2) - 1;
+        minus.e = v.e - 2;
+    } else {
+        minus.f = (v.f << 1) - 1;
+        minus.e = v.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    /* 10^-k that brings the binary exponent of the product into [-60, -32] */
+    dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    cached_ix = (int)dk;
+    if (dk - cached_ix > 0.0) {
+        cached_ix++;
+    }
+    cached_ix = (cached_ix >> 3) + 1;
+    *k = -(-348 + cached_ix * 8);
+    c_mk.f = PARSON_U64(parson_cached_powers[cached_ix].hi, parson_cached_powers[cached_ix].lo);
+    c_mk.e = parson_cached_powers[cached_ix].e;
+    return grisu_digits(diy_fp_multiply(minus, c_mk), diy_fp_multiply(diy_fp_normalize(v), c_mk),
+                        diy_fp_multiply(plus, c_mk), buf, k);
+}
+
+/* Finds the shortest digits that read back as num by trying 1 to 17 significant digits, for
+   doubles grisu3 isn't sure about. printf gives the closest digits of each length, but for powers
+   of 2 the lower boundary is closer, so the next digits up may read back when the closest don't. */
+static int shortest_digits_exact(double num, char *buf, int *k) {
+    char formatted[PARSON_NUM_BUF_SIZE];
+    char candidate[PARSON_NUM_BUF_SIZE];
+    int precision = 0, len = 0, exponent = 0, i = 0, attempt = 0;
+    for (precision = 1; precision <= 17; precision++) {
+        parson_sprintf(formatted, "%.*e", precision - 1, num);
+        len = 0;
+        for (i = 0; formatted[i] != 'e'; i++) {
+            if (formatted[i] >= '0' && formatted[i] <= '9') { /* skips the (locale's) decimal point */
+                buf[len++] = formatted[i];
+            }
+        }
+        exponent = atoi(formatted + i + 1) - (len - 1);
+        for (attempt = 0; attempt < 2; attempt++) {
+            if (attempt == 1) { /* the digits one up, e.g. 1299 -> 1300 */
+                for (i = len - 1; i >= 0 && buf[i] == '9'; i--) {
+                    buf[i] = '0';
                 }
-                break;
-            default:
-                if (buf != NULL) {
-                    buf[0] = c;
-                    buf += 1;
+                if (i < 0) {
+                    break; /* 10^n has fewer digits, so it was already tried */
                 }
-                written_total += 1;
-                break;
+                buf[i]++;
+            }
+            memcpy(candidate, buf, len);
+            parson_sprintf(candidate + len, "e%d", exponent);
+            if (strtod(candidate, NULL) == num) {
+                while (len > 1 && buf[len - 1] == '0') {
+                    len--;
+                    exponent++;
+                }
+                *k = exponent;
+                return len;
+            }
+        }
+    }
+    return -1; /* unreachable, 17 digits always read back */
+}
+
+/* Formats num like "%1.17g" would, but with as few digits as needed to read it back. */
+/* With canonical set numbers are laid out like ECMAScript's Number.prototype.toString (RFC 8785) */
+static int format_shortest_number(double num, char *buf, parson_bool_t canonical) {
+    char digits[24];
+    parson_u64_t bits = 0, integral = 0;
+    int len = 0, k = 0, exponent = 0, written = 0, i = 0;
+    if (IS_NUMBER_INVALID(num)) {
+        return parson_sprintf(buf, "%1.17g", num);
+    }
+    memcpy(&bits, &num, sizeof(bits));
+    if (bits >> 63) {
+        if (!canonical || num != 0.0) {
+            buf[written++] = '-';
+        }
+        num = -num;
+    }
+    if (num < 9007199254740992.0) { /* integers below 2^53 are exact */
+        integral = (parson_u64_t)num;
+        if ((double)integral == num) {
+            do {
+                digits[len++] = (char)('0' + (int)(integral % 10));
+                integral /= 10;
+            } while (integral > 0);
+            while (len > 0) {
+                buf[written++] = digits[--len];
+            }
+            buf[written] = '\0';
+            return written;
         }
     }
-    APPEND_STRING("\"");
-    return written_total;
+    len = grisu3(num, digits, &k);
+    if (len < 0) {
+        len = shortest_digits_exact(num, digits, &k);
+    }
+    exponent = len + k - 1; /* of the first digit */
+    if (canonical ? (exponent >= -6 && exponent < 21) : (exponent >= -4 && exponent < 17)) {
+        if (k >= 0) {
+            memcpy(buf + written, digits, len);
+            written += len;
+            for (i = 0; i < k; i++) {
+                buf[written++] = '0';
+            }
+        } else if (exponent >= 0) {
+            memcpy(buf + written, digits, exponent + 1);
+            written += exponent + 1;
+            buf[written++] = '.';
+            memcpy(buf + written, digits + exponent + 1, len - exponent - 1);
+            written += len - exponent - 1;
+        } else {
+            buf[written++] = '0';
+            buf[written++] = '.';
+            for (i = -1; i > exponent; i--) {
+                buf[written++] = '0';
+            }
+            memcpy(buf + written, digits, len);
+            written += len;
+        }
+    } else {
+        buf[written++] = digits[0];
+        if (len > 1) {
+            buf[written++] = '.';
+            memcpy(buf + written, digits + 1, len - 1);
+            written += len - 1;
+        }
+        written += parson_sprintf(buf + written, canonical ? "e%c%d" : "e%c%02d",
+                                  exponent < 0 ? '-' : '+', exponent < 0 ? -exponent : exponent);
+    }
+    buf[written] = '\0';
+    return written;
+}
+#endif
+
+static void json_serialize_number(double num, JSON_Writer *writer, const JSON_Serialize_Options *options) {
+    char *num_buf = writer_reserve(writer, PARSON_NUM_BUF_SIZE);
+    int written = -1;
+    if (options->canonical) {
+#ifdef PARSON_SHORTEST_NUMBERS
+        written = format_shortest_number(num, num_buf, PARSON_TRUE);
+#else
+        written = -1; /* printf can't produce the shortest representation */
+#endif
+    } else if (options->number_serialization_function) {
+        written = options->number_serialization_function(num, num_buf);
+    } else if (options->float_format) {
+        written = parson_sprintf(num_buf, options->float_format, num);
+    } else {
+#ifdef PARSON_DEFAULT_FLOAT_FORMAT
+        written = parson_sprintf(num_buf, PARSON_DEFAULT_FLOAT_FORMAT, num);
+#else
+        written = format_shortest_number(num, num_buf, PARSON_FALSE);
+#endif
+    }
+    if (written < 0) {
+        writer->failed = PARSON_TRUE;
+        return;
+    }
+    writer_commit(writer, num_buf, (size_t)written);
+}
+
+/* Orders pointers to object names by UTF-16 code units of the names (RFC 8785). UTF-8 orders by code
+   points, which differs only for characters above U+FFFF (surrogates in UTF-16) and U+E000-U+FFFF. */
+static int compare_names_utf16(const void *a, const void *b) {
+    const unsigned char *a_name = (const unsigned char*)**(char * const * const *)a;
+    const unsigned char *b_name = (const unsigned char*)**(char * const * const *)b;
+    while (*a_name == *b_name && *a_name != '\0') {
+        a_name++;
+        b_name++;
+    }
+    if (*a_name >= 0xF0 && (*b_name == 0xEE || *b_name == 0xEF)) {
+        return -1;
+    } else if (*b_name >= 0xF0 && (*a_name == 0xEE || *a_name == 0xEF)) {
+        return 1;
+    }
+    return (int)*a_name - (int)*b_name;
 }
 
-#undef APPEND_STRING
-#undef APPEND_INDENT
+/* Character following a backslash in the escape sequence of a byte, 'u' for \\u00XX, 0 if it isn't escaped.
+   Slashes are escaped only if escape_slashes is set (to make json embeddable in xml\\/html). */
+static const char parson_escape_table[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '/',
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '\\', 0,   0,   0
+    /* remaining bytes are never escaped */
+};
+
+static void json_serialize_string(const char *string, size_t len, JSON_Writer *writer, parson_bool_t escape_slashes) {
+    /* checking for quotes twice is cheaper than a branch when slashes aren't escaped */
+    const size_t slash = WORD_ONES * (unsigned char)(escape_slashes ? '/' : '\"');
+    size_t i = 0, end = 0, run_start = 0, word = 0;
+    char escaped[7] = "\\u00XX";
+    char escape = '\0';
+    unsigned char c = 0;
+    writer_write(writer, "\"", 1);
+    while (i < len) {
+        /* skips words without bytes to escape */
+        while (len - i >= sizeof(word)) {
+            memcpy(&word, string + i, sizeof(word));
+            if (WORD_HAS_BYTE_LESS_THAN(word, 0x20) | WORD_HAS_BYTE(word, '"')
+                | WORD_HAS_BYTE(word, '\\') | WORD_HAS_ZERO_BYTE(word ^ slash)) {
+                break;
+            }
+            i += sizeof(word);
+        }
+        end = len - i > sizeof(word) ? i + sizeof(word) : len;
+        for (; i < end; i++) {
+            c = (unsigned char)string[i];
+            escape = parson_escape_table[c];
+            if (escape != '\0' && (escape != '/' || escape_slashes)) {
+                break;
+            }
+        }
+        if (i == end) {
+            continue;
+        }
+        writer_write_run(writer, string + run_start, i - run_start);
+        escaped[1] = escape;
+        if (escape == 'u') {
+            escaped[4] = "0123456789abcdef"[c >> 4];
+            escaped[5] = "0123456789abcdef"[c & 0xf];
+            writer_write(writer, escaped, 6);
+        } else {
+            writer_write(writer, escaped, 2);
+        }
+        i++;
+        run_start = i;
+    }
+    writer_write_run(writer, string + run_start, len - run_start);
+    writer_write(writer, "\"", 1);
+}
 
 /* Parser API */
+void json_parse_options_init(JSON_Parse_Options *options) {
+    options->with_comments = 0;
+    options->allocator = NULL;
+    options->pack_arrays = 0;
+    options->retain_source = 0;
+    options->dedupe = 0;
+    options->intern_strings = 0;
+}
+
 JSON_Value * json_parse_file(const char *filename) {
-    char *file_contents = read_file(filename);
-    JSON_Value *output_value = NULL;
-    if (file_contents == NULL) {
-        return NULL;
-    }
-    output_value = json_parse_string(file_contents);
-    parson_free(file_contents);
-    return output_value;
+    return json_parse_file_ex(filename, NULL);
 }
 
 JSON_Value * json_parse_file_with_comments(const char *filename) {
+    JSON_Parse_Options options;
+    json_parse_options_init(&options);
+    options.with_comments = 1;
+    return json_parse_file_ex(filename, &options);
+}
+
+JSON_Value * json_parse_file_ex(const char *filename, const JSON_Parse_Options *options) {
     char *file_contents = read_file(filename);
     JSON_Value *output_value = NULL;
     if (file_contents == NULL) {
         return NULL;
     }
-    output_value = json_parse_string_with_comments(file_contents);
+    output_value = json_parse_string_ex(file_contents, options);
     parson_free(file_contents);
     return output_value;
 }
 
 JSON_Value * json_parse_string(const char *string) {
-    if (string == NULL) {
-        return NULL;
-    }
-    if (string[0] == '\xEF' && string[1] == '\xBB' && string[2] == '\xBF') {
-        string = string + 3; /* Support for UTF-8 BOM */
-    }
-    return parse_value((const char**)&string, 0);
+    return json_parse_string_ex(string, NULL);
+}
+
+JSON_Value * json_parse_string_with_allocator(const char *string, const JSON_Allocator *allocator) {
+    JSON_Parse_Options options;
+    json_parse_options_init(&options);
+    options.allocator = allocator;
+    return json_parse_string_ex(string, &options);
 }
 
 JSON_Value * json_parse_string_with_comments(const char *string) {
+    JSON_Parse_Options options;
+    json_parse_options_init(&options);
+    options.with_comments = 1;
+    return json_parse_string_ex(string, &options);
+}
+
+JSON_Value * json_parse_string_ex(const char *string, const JSON_Parse_Options *options) {
+    JSON_Allocator prev_allocator = parson_thread_allocator;
+    parson_bool_t prev_allocator_set = parson_thread_allocator_set;
+    JSON_Parse_Options default_options;
     JSON_Value *result = NULL;
+    JSON_Source *source = NULL;
+    JSON_Intern_Table intern_table, *interns = NULL;
     char *string_mutable_copy = NULL, *string_mutable_copy_ptr = NULL;
-    string_mutable_copy = parson_strdup(string);
-    if (string_mutable_copy == NULL) {
+    if (string == NULL) {
         return NULL;
     }
-    remove_comments(string_mutable_copy, "/*", "*/");
-    remove_comments(string_mutable_copy, "//", "\n");
-    string_mutable_copy_ptr = string_mutable_copy;
-    result = parse_value((const char**)&string_mutable_copy_ptr, 0);
+    if (options == NULL) {
+        json_parse_options_init(&default_options);
+        options = &default_options;
+    }
+    if (options->allocator) {
+        json_set_thread_allocator(options->allocator);
+    }
+    if (options->with_comments || options->retain_source) {
+        string_mutable_copy = parson_strdup(string);
+        if (string_mutable_copy == NULL) {
+            goto end;
+        }
+        string = string_mutable_copy;
+    }
+    if (options->with_comments) {
+        remove_comments(string_mutable_copy, "/*", "*/");
+        remove_comments(string_mutable_copy, "//", "\n");
+    }
+#ifndef PARSON_COMPACT_VALUES
+    if (options->retain_source) {
+        source = json_source_make(string_mutable_copy);
+        if (source == NULL) {
+            goto end;
+        }
+        string_mutable_copy = NULL; /* owned by source */
+    }
+#endif
+    if (string[0] == '\xEF' && string[1] == '\xBB' && string[2] == '\xBF') {
+        string = string + 3; /* Support for UTF-8 BOM */
+    }
+    if (options->intern_strings) {
+        memset(&intern_table, 0, sizeof(JSON_Intern_Table));
+        interns = &intern_table;
+    }
+    string_mutable_copy_ptr = (char*)string;
+    result = parse_value((const char**)&string_mutable_copy_ptr, 0, options, source, interns);
+    if (result != NULL && options->dedupe) {
+        json_value_dedupe(result); /* on failure result is just left unshared */
+    }
+end:
     parson_free(string_mutable_copy);
+    if (interns) {
+        json_intern_table_deinit(interns);
+    }
+#ifndef PARSON_COMPACT_VALUES
+    if (source) {
+        json_source_release(source);
+    }
+#endif
+    parson_thread_allocator = prev_allocator;
+    parson_thread_allocator_set = prev_allocator_set;
     return result;
 }
 
@@ -1438,6 +3449,70 @@ int json_object_get_boolean(const JSON_Object *object, const char *name) {
     return json_value_get_boolean(json_object_get_value(object, name));
 }
 
+JSON_Key * json_key_make(const char *name) {
+    JSON_Key *key = NULL;
+    size_t name_len = 0;
+    char *name_copy = NULL;
+    if (name == NULL) {
+        return NULL;
+    }
+    name_len = strlen(name);
+    /* name is stored right after the key, so a key is a single allocation */
+    key = (JSON_Key*)parson_malloc(sizeof(JSON_Key) + name_len + 1);
+    if (key == NULL) {
+        return NULL;
+    }
+    name_copy = (char*)(key + 1);
+    memcpy(name_copy, name, name_len + 1);
+    key->name = name_copy;
+    key->length = name_len;
+    key->hash = hash_string(name, name_len);
+    return key;
+}
+
+void json_key_free(JSON_Key *key) {
+    parson_free(key);
+}
+
+const char * json_key_get_name(const JSON_Key *key) {
+    return key ? key->name : NULL;
+}
+
+JSON_Value * json_object_get_value_by_key(const JSON_Object *object, const JSON_Key *key) {
+    if (object == NULL || key == NULL) {
+        return NULL;
+    }
+    return json_object_get_value_with_hash(object, key->name, key->length, key->hash);
+}
+
+const char * json_object_get_string_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_string(json_object_get_value_by_key(object, key));
+}
+
+size_t json_object_get_string_len_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_string_len(json_object_get_value_by_key(object, key));
+}
+
+JSON_Object * json_object_get_object_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_object(json_object_get_value_by_key(object, key));
+}
+
+JSON_Array * json_object_get_array_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_array(json_object_get_value_by_key(object, key));
+}
+
+double json_object_get_number_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_number(json_object_get_value_by_key(object, key));
+}
+
+int json_object_get_boolean_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_value_get_boolean(json_object_get_value_by_key(object, key));
+}
+
+int json_object_has_value_by_key(const JSON_Object *object, const JSON_Key *key) {
+    return json_object_get_value_by_key(object, key) != NULL;
+}
+
 JSON_Value * json_object_dotget_value(const JSON_Object *object, const char *name) {
     const char *dot_position = strchr(name, '.');
     if (!dot_position) {
@@ -1493,7 +3568,7 @@ JSON_Value *json_object_get_wrapping_value(const JSON_Object *object) {
     if (!object) {
         return NULL;
     }
-    return object->wrapping_value;
+    return &((JSON_Object_Value*)((char*)object - offsetof(JSON_Object_Value, object)))->value;
 }
 
 int json_object_has_value (const JSON_Object *object, const char *name) {
@@ -1519,33 +3594,78 @@ JSON_Value * json_array_get_value(const JSON_Array *array, size_t index) {
     if (array == NULL || index >= json_array_get_count(array)) {
         return NULL;
     }
+    if (array->packing != ARRAY_BOXED) { /* items of packed arrays don't have values */
+        return NULL;
+    }
     return array->items[index];
 }
 
 const char * json_array_get_string(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        return NULL;
+    }
     return json_value_get_string(json_array_get_value(array, index));
 }
 
 size_t json_array_get_string_len(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        return 0;
+    }
     return json_value_get_string_len(json_array_get_value(array, index));
 }
 
 double json_array_get_number(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        if (array->packing != ARRAY_PACKED_NUMBERS || index >= array->count) {
+            return 0;
+        }
+        return ARRAY_NUMBERS(array)[index];
+    }
     return json_value_get_number(json_array_get_value(array, index));
 }
 
 JSON_Object * json_array_get_object(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        return NULL;
+    }
     return json_value_get_object(json_array_get_value(array, index));
 }
 
 JSON_Array * json_array_get_array(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        return NULL;
+    }
     return json_value_get_array(json_array_get_value(array, index));
 }
 
 int json_array_get_boolean(const JSON_Array *array, size_t index) {
+    if (array && array->packing != ARRAY_BOXED) {
+        if (array->packing != ARRAY_PACKED_BOOLEANS || index >= array->count) {
+            return -1;
+        }
+        return ARRAY_GET_BIT(array, index);
+    }
     return json_value_get_boolean(json_array_get_value(array, index));
 }
 
+JSON_Value_Type json_array_get_item_type(const JSON_Array *array, size_t index) {
+    if (array == NULL || index >= array->count) {
+        return JSONError;
+    }
+    switch (array->packing) {
+        case ARRAY_PACKED_NUMBERS:  return JSONNumber;
+        case ARRAY_PACKED_BOOLEANS: return JSONBoolean;
+        default:                    return json_value_get_type(array->items[index]);
+    }
+}
+
+const double * json_array_get_numbers(const JSON_Array *array) {
+    if (array == NULL || array->packing != ARRAY_PACKED_NUMBERS) {
+        return NULL;
+    }
+    return ARRAY_NUMBERS(array);
+}
+
 size_t json_array_get_count(const JSON_Array *array) {
     return array ? array->count : 0;
 }
@@ -1554,34 +3674,44 @@ JSON_Value * json_array_get_wrapping_value(const JSON_Array *array) {
     if (!array) {
         return NULL;
     }
-    return array->wrapping_value;
+    return &((JSON_Array_Value*)((char*)array - offsetof(JSON_Array_Value, array)))->value;
 }
 
 /* JSON Value API */
 JSON_Value_Type json_value_get_type(const JSON_Value *value) {
-    return value ? value->type : JSONError;
+    return value ? (JSON_Value_Type)value->type : JSONError;
 }
 
 JSON_Object * json_value_get_object(const JSON_Value *value) {
-    return json_value_get_type(value) == JSONObject ? value->value.object : NULL;
+    return json_value_get_type(value) == JSONObject ? &((JSON_Object_Value*)value)->object : NULL;
 }
 
 JSON_Array * json_value_get_array(const JSON_Value *value) {
-    return json_value_get_type(value) == JSONArray ? value->value.array : NULL;
-}
-
-static const JSON_String * json_value_get_string_desc(const JSON_Value *value) {
-    return json_value_get_type(value) == JSONString ? &value->value.string : NULL;
+    return json_value_get_type(value) == JSONArray ? &((JSON_Array_Value*)value)->array : NULL;
 }
 
 const char * json_value_get_string(const JSON_Value *value) {
-    const JSON_String *str = json_value_get_string_desc(value);
-    return str ? str->chars : NULL;
+    if (json_value_get_type(value) != JSONString) {
+        return NULL;
+    }
+    if (value->flags & VALUE_FLAG_SHORT_STRING) {
+        return value->value.short_string;
+    }
+    return value->value.string.chars;
 }
 
 size_t json_value_get_string_len(const JSON_Value *value) {
-    const JSON_String *str = json_value_get_string_desc(value);
-    return str ? str->length : 0;
+    if (json_value_get_type(value) != JSONString) {
+        return 0;
+    }
+    if (value->flags & VALUE_FLAG_SHORT_STRING) {
+        return (unsigned char)value->value.short_string[sizeof(value->value.short_string) - 1];
+    }
+#ifdef PARSON_COMPACT_VALUES
+    return value->string_length;
+#else
+    return value->value.string.length;
+#endif
 }
 
 double json_value_get_number(const JSON_Value *value) {
@@ -1593,51 +3723,238 @@ int json_value_get_boolean(const JSON_Value *value) {
 }
 
 JSON_Value * json_value_get_parent (const JSON_Value *value) {
-    return value ? value->parent : NULL;
+#ifdef PARSON_COMPACT_VALUES
+    (void)value;
+    return NULL;
+#else
+    if (value == NULL) {
+        return NULL;
+    }
+    return value->parent; /* NULL for shared values, which have several parents */
+#endif
 }
 
 void json_value_free(JSON_Value *value) {
+#ifndef PARSON_COMPACT_VALUES
+    if (json_value_get_type(value) == JSONObject || json_value_get_type(value) == JSONArray) {
+        JSON_Serialization_Cache *cache = ((JSON_Container_Value*)value)->cache;
+        if ((value->flags & VALUE_FLAG_SHARED) && cache->owners > 1) {
+            cache->owners--; /* still held by another parent */
+            return;
+        }
+        if (cache) {
+            json_cache_release_data(cache);
+            parson_free(cache);
+        }
+    }
+#endif
     switch (json_value_get_type(value)) {
         case JSONObject:
-            json_object_free(value->value.object);
+            json_object_deinit(&((JSON_Object_Value*)value)->object, PARSON_TRUE, PARSON_TRUE);
             break;
         case JSONString:
-            parson_free(value->value.string.chars);
+            if (value->flags & VALUE_FLAG_INTERNED) {
+                json_interned_release(value->value.string.chars);
+            } else if (!(value->flags & VALUE_FLAG_SHORT_STRING)) {
+                parson_free(value->value.string.chars);
+            }
             break;
         case JSONArray:
-            json_array_free(value->value.array);
+            json_array_deinit(&((JSON_Array_Value*)value)->array);
             break;
         default:
             break;
     }
-    parson_free(value);
+    json_value_dealloc(value);
+}
+
+JSON_Status json_value_set_serialization_cache(JSON_Value *value, int enabled) {
+#ifdef PARSON_COMPACT_VALUES
+    (void)value;
+    (void)enabled;
+    return JSONFailure;
+#else
+    if (json_value_get_type(value) != JSONObject && json_value_get_type(value) != JSONArray) {
+        return JSONFailure;
+    }
+    if (enabled) {
+        value->flags |= VALUE_FLAG_CACHE_OUTPUT;
+        return JSONSuccess;
+    }
+    value->flags &= ~VALUE_FLAG_CACHE_OUTPUT;
+    if (!json_value_is_frozen(value)) {
+        json_value_drop_caches(value);
+        json_value_invalidate_cache(value->parent); /* parents' output included the dropped caches */
+    }
+    return JSONSuccess;
+#endif
+}
+
+JSON_Status json_value_set_hash_cache(JSON_Value *value, int enabled) {
+#ifdef PARSON_COMPACT_VALUES
+    (void)value;
+    (void)enabled;
+    return JSONFailure;
+#else
+    if (json_value_get_type(value) != JSONObject && json_value_get_type(value) != JSONArray) {
+        return JSONFailure;
+    }
+    if (enabled) {
+        value->flags |= VALUE_FLAG_CACHE_HASH;
+    } else {
+        value->flags &= ~VALUE_FLAG_CACHE_HASH; /* hashes already stored stay valid until changes */
+    }
+    return JSONSuccess;
+#endif
+}
+
+JSON_Status json_value_dedupe(JSON_Value *value) {
+#ifdef PARSON_COMPACT_VALUES
+    (void)value;
+    return JSONFailure;
+#else
+    JSON_Value **table = NULL, *parent = NULL;
+    JSON_Serialization_Cache *cache = NULL;
+    size_t table_size = 1, count = 0;
+    parson_bool_t hashed = PARSON_TRUE;
+    if ((json_value_get_type(value) != JSONObject && json_value_get_type(value) != JSONArray)
+        || json_value_is_frozen(value)) {
+        return JSONFailure;
+    }
+    count = json_value_count_containers(value);
+    while (table_size < count * 2) {
+        table_size *= 2;
+    }
+    table = (JSON_Value**)parson_malloc(table_size * sizeof(JSON_Value*));
+    if (table != NULL) {
+        memset(table, 0, table_size * sizeof(JSON_Value*));
+        json_value_hash_r(value, PARSON_TRUE, &hashed); /* every container gets a cached hash */
+        if (hashed) {
+            json_value_dedupe_r(value, table, table_size - 1);
+        }
+    }
+    json_value_release_hashes(value);
+    for (parent = value->parent; parent != NULL; parent = parent->parent) {
+        cache = ((JSON_Container_Value*)parent)->cache;
+        if (cache == NULL || !cache->hash_valid) {
+            break;
+        }
+        cache->hash_valid = PARSON_FALSE; /* hashes inside value were dropped */
+    }
+    if (table == NULL) {
+        return JSONFailure;
+    }
+    parson_free(table);
+    return hashed ? JSONSuccess : JSONFailure;
+#endif
+}
+
+JSON_Status json_value_shrink_to_fit(JSON_Value *value) {
+    JSON_Array *array = NULL;
+    JSON_Object *object = NULL;
+    size_t i = 0, cell_capacity = 0;
+    if (json_value_is_frozen(value)) {
+        return JSONSuccess; /* shared subtrees are left as they are */
+    }
+    switch (json_value_get_type(value)) {
+        case JSONArray:
+            array = json_value_get_array(value);
+            for (i = 0; array->packing == ARRAY_BOXED && i < array->count; i++) {
+                if (json_value_shrink_to_fit(array->items[i]) != JSONSuccess) {
+                    return JSONFailure;
+                }
+            }
+            if (array->count == 0) {
+                json_array_deinit(array);
+            } else if (array->capacity > array->count) {
+                return json_array_resize(array, array->count);
+            }
+            return JSONSuccess;
+        case JSONObject:
+            object = json_value_get_object(value);
+            for (i = 0; i < object->count; i++) {
+                if (json_value_shrink_to_fit(object->values[i]) != JSONSuccess) {
+                    return JSONFailure;
+                }
+            }
+            if (object->count == 0) {
+                json_object_deinit(object, PARSON_FALSE, PARSON_FALSE);
+                return JSONSuccess;
+            }
+            cell_capacity = json_object_cell_capacity_for(object->count);
+            if (cell_capacity < object->cell_capacity) {
+                return json_object_rehash(object, cell_capacity);
+            }
+            return JSONSuccess;
+        case JSONError:
+            return JSONFailure;
+        default:
+            return JSONSuccess;
+    }
+}
+
+void json_value_free_with_allocator(JSON_Value *value, const JSON_Allocator *allocator) {
+    JSON_Allocator prev_allocator = parson_thread_allocator;
+    parson_bool_t prev_allocator_set = parson_thread_allocator_set;
+    json_set_thread_allocator(allocator);
+    json_value_free(value);
+    parson_thread_allocator = prev_allocator;
+    parson_thread_allocator_set = prev_allocator_set;
 }
 
 JSON_Value * json_value_init_object(void) {
-    JSON_Value *new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = json_value_make(JSONObject);
     if (!new_value) {
         return NULL;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONObject;
-    new_value->value.object = json_object_make(new_value);
-    if (!new_value->value.object) {
-        parson_free(new_value);
+    if (json_object_init(&((JSON_Object_Value*)new_value)->object, 0) != JSONSuccess) {
+        json_value_dealloc(new_value);
         return NULL;
     }
     return new_value;
 }
 
 JSON_Value * json_value_init_array(void) {
-    JSON_Value *new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = json_value_make(JSONArray);
     if (!new_value) {
         return NULL;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONArray;
-    new_value->value.array = json_array_make(new_value);
-    if (!new_value->value.array) {
-        parson_free(new_value);
+    json_array_init(&((JSON_Array_Value*)new_value)->array);
+    return new_value;
+}
+
+JSON_Value * json_value_init_object_with_capacity(size_t capacity) {
+    JSON_Value *new_value = json_value_init_object();
+    if (!new_value) {
+        return NULL;
+    }
+    if (json_object_reserve(json_value_get_object(new_value), capacity) != JSONSuccess) {
+        json_value_free(new_value);
+        return NULL;
+    }
+    return new_value;
+}
+
+JSON_Value * json_value_init_array_with_capacity(size_t capacity) {
+    JSON_Value *new_value = json_value_init_array();
+    if (!new_value) {
+        return NULL;
+    }
+    if (json_array_reserve(json_value_get_array(new_value), capacity) != JSONSuccess) {
+        json_value_free(new_value);
+        return NULL;
+    }
+    return new_value;
+}
+
+JSON_Value * json_value_init_array_from_numbers(const double *numbers, size_t count) {
+    JSON_Value *new_value = json_value_init_array();
+    if (!new_value) {
+        return NULL;
+    }
+    json_value_get_array(new_value)->packing = ARRAY_PACKED_NUMBERS;
+    if (json_array_append_numbers(json_value_get_array(new_value), numbers, count) != JSONSuccess) {
+        json_value_free(new_value);
         return NULL;
     }
     return new_value;
@@ -1659,6 +3976,9 @@ JSON_Value * json_value_init_string_with_len(const char *string, size_t length)
     if (!is_valid_utf8(string, length)) {
         return NULL;
     }
+    if (length <= SHORT_STRING_MAX_LEN) {
+        return json_value_init_short_string(string, length);
+    }
     copy = parson_strndup(string, length);
     if (copy == NULL) {
         return NULL;
@@ -1675,41 +3995,36 @@ JSON_Value * json_value_init_number(double number) {
     if (IS_NUMBER_INVALID(number)) {
         return NULL;
     }
-    new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
+    new_value = json_value_make(JSONNumber);
     if (new_value == NULL) {
         return NULL;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONNumber;
     new_value->value.number = number;
     return new_value;
 }
 
 JSON_Value * json_value_init_boolean(int boolean) {
-    JSON_Value *new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = json_value_make(JSONBoolean);
     if (!new_value) {
         return NULL;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONBoolean;
     new_value->value.boolean = boolean ? 1 : 0;
     return new_value;
 }
 
 JSON_Value * json_value_init_null(void) {
-    JSON_Value *new_value = (JSON_Value*)parson_malloc(sizeof(JSON_Value));
+    JSON_Value *new_value = json_value_make(JSONNull);
     if (!new_value) {
         return NULL;
     }
-    new_value->parent = NULL;
-    new_value->type = JSONNull;
     return new_value;
 }
 
 JSON_Value * json_value_deep_copy(const JSON_Value *value) {
     size_t i = 0;
     JSON_Value *return_value = NULL, *temp_value_copy = NULL, *temp_value = NULL;
-    const JSON_String *temp_string = NULL;
+    const char *temp_string = NULL;
+    size_t temp_string_len = 0;
     const char *temp_key = NULL;
     char *temp_string_copy = NULL;
     JSON_Array *temp_array = NULL, *temp_array_copy = NULL;
@@ -1725,6 +4040,13 @@ JSON_Value * json_value_deep_copy(const JSON_Value *value) {
                 return NULL;
             }
             temp_array_copy = json_value_get_array(return_value);
+            if (temp_array->packing != ARRAY_BOXED) {
+                if (json_array_copy_packed(temp_array_copy, temp_array) != JSONSuccess) {
+                    json_value_free(return_value);
+                    return NULL;
+                }
+                return return_value;
+            }
             for (i = 0; i < json_array_get_count(temp_array); i++) {
                 temp_value = json_array_get_value(temp_array, i);
                 temp_value_copy = json_value_deep_copy(temp_value);
@@ -1774,15 +4096,20 @@ JSON_Value * json_value_deep_copy(const JSON_Value *value) {
         case JSONNumber:
             return json_value_init_number(json_value_get_number(value));
         case JSONString:
-            temp_string = json_value_get_string_desc(value);
+            temp_string = json_value_get_string(value);
+            temp_string_len = json_value_get_string_len(value);
             if (temp_string == NULL) {
                 return NULL;
             }
-            temp_string_copy = parson_strndup(temp_string->chars, temp_string->length);
+            if (temp_string_len <= SHORT_STRING_MAX_LEN) {
+                return json_value_init_short_string(temp_string, temp_string_len);
+            }
+            /* interned characters are copied too, so copies don't share reference counts with value */
+            temp_string_copy = parson_strndup(temp_string, temp_string_len);
             if (temp_string_copy == NULL) {
                 return NULL;
             }
-            return_value = json_value_init_string_no_copy(temp_string_copy, temp_string->length);
+            return_value = json_value_init_string_no_copy(temp_string_copy, temp_string_len);
             if (return_value == NULL) {
                 parson_free(temp_string_copy);
             }
@@ -1796,135 +4123,345 @@ JSON_Value * json_value_deep_copy(const JSON_Value *value) {
     }
 }
 
+void json_serialize_options_init(JSON_Serialize_Options *options) {
+    options->pretty = 0;
+    options->escape_slashes = 1;
+    options->float_format = NULL;
+    options->number_serialization_function = NULL;
+    options->indent = NULL;
+    options->newline = NULL;
+    options->canonical = 0;
+}
+
 size_t json_serialization_size(const JSON_Value *value) {
-    char num_buf[PARSON_NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, PARSON_FALSE, num_buf);
-    return res < 0 ? 0 : (size_t)(res) + 1;
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_FALSE);
+    return json_serialization_size_ex(value, &options);
 }
 
 JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes) {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_FALSE);
+    return json_serialize_to_buffer_ex(value, buf, buf_size_in_bytes, &options);
+}
+
+JSON_Status json_serialize_to_file(const JSON_Value *value, const char *filename) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_FALSE);
+    return json_serialize_to_file_ex(value, filename, &options);
+}
+
+char * json_serialize_to_string(const JSON_Value *value) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_FALSE);
+    return json_serialize_to_string_ex(value, &options);
+}
+
+size_t json_serialization_size_pretty(const JSON_Value *value) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_TRUE);
+    return json_serialization_size_ex(value, &options);
+}
+
+JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf, size_t buf_size_in_bytes) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_TRUE);
+    return json_serialize_to_buffer_ex(value, buf, buf_size_in_bytes, &options);
+}
+
+JSON_Status json_serialize_to_file_pretty(const JSON_Value *value, const char *filename) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_TRUE);
+    return json_serialize_to_file_ex(value, filename, &options);
+}
+
+char * json_serialize_to_string_pretty(const JSON_Value *value) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_TRUE);
+    return json_serialize_to_string_ex(value, &options);
+}
+
+size_t json_serialization_size_ex(const JSON_Value *value, const JSON_Serialize_Options *options) {
+    JSON_Serialize_Options default_options;
+    JSON_Writer writer;
+    if (options == NULL) {
+        json_serialize_options_init(&default_options);
+        options = &default_options;
+    }
+    writer_init(&writer, WRITER_COUNT, NULL, 0);
+    writer_set_layout(&writer, options);
+    if (json_serialize_to_writer_r(value, &writer, 0, options, SERIALIZE_CACHE_NONE) != JSONSuccess || writer.failed) {
+        return 0;
+    }
+    return writer.len + 1;
+}
+
+JSON_Status json_serialize_to_buffer_ex(const JSON_Value *value, char *buf, size_t buf_size_in_bytes, const JSON_Serialize_Options *options) {
+    JSON_Serialize_Options default_options;
+    JSON_Writer writer;
+    if (buf == NULL || buf_size_in_bytes == 0) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, PARSON_FALSE, NULL);
-    if (written < 0) {
+    if (options == NULL) {
+        json_serialize_options_init(&default_options);
+        options = &default_options;
+    }
+    writer_init(&writer, WRITER_FIXED, buf, buf_size_in_bytes);
+    writer_set_layout(&writer, options);
+    if (json_serialize_to_writer_r(value, &writer, 0, options, SERIALIZE_CACHE_NONE) != JSONSuccess || writer.failed) {
+        buf[0] = '\0'; /* error or truncated output, which isn't left in buf */
         return JSONFailure;
     }
+    buf[writer.len] = '\0';
     return JSONSuccess;
 }
 
-JSON_Status json_serialize_to_file(const JSON_Value *value, const char *filename) {
+JSON_Status json_serialize_to_file_ex(const JSON_Value *value, const char *filename, const JSON_Serialize_Options *options) {
     JSON_Status return_code = JSONSuccess;
     FILE *fp = NULL;
-    char *serialized_string = json_serialize_to_string(value);
-    if (serialized_string == NULL) {
+    /* a missing value fails before the file is opened (and truncated), other failures
+       (e.g. out of memory) are only found while writing and leave it incomplete */
+    if (json_value_get_type(value) == JSONError) {
         return JSONFailure;
     }
     fp = fopen(filename, "w");
     if (fp == NULL) {
-        json_free_serialized_string(serialized_string);
         return JSONFailure;
     }
-    if (fputs(serialized_string, fp) == EOF) {
-        return_code = JSONFailure;
-    }
+    return_code = json_serialize_to_fp(value, fp, options);
     if (fclose(fp) == EOF) {
         return_code = JSONFailure;
     }
-    json_free_serialized_string(serialized_string);
     return return_code;
 }
 
-char * json_serialize_to_string(const JSON_Value *value) {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
+JSON_Status json_serialize_to_stream(const JSON_Value *value, JSON_Write_Function write_fun, void *ctx) {
+    JSON_Serialize_Options options;
+    json_serialize_options_from_globals(&options, PARSON_FALSE);
+    return json_serialize_to_stream_ex(value, write_fun, ctx, &options);
+}
+
+JSON_Status json_serialize_to_stream_ex(const JSON_Value *value, JSON_Write_Function write_fun, void *ctx, const JSON_Serialize_Options *options) {
+    char buf[PARSON_STREAM_BUF_SIZE];
+    JSON_Serialize_Options default_options;
+    JSON_Writer writer;
+    if (write_fun == NULL) {
+        return JSONFailure;
+    }
+    if (options == NULL) {
+        json_serialize_options_init(&default_options);
+        options = &default_options;
+    }
+    writer_init(&writer, WRITER_STREAM, buf, sizeof(buf));
+    writer_set_layout(&writer, options);
+    writer.write_fun = write_fun;
+    writer.write_ctx = ctx;
+    if (json_serialize_to_writer_r(value, &writer, 0, options, SERIALIZE_CACHE_NONE) != JSONSuccess) {
+        return JSONFailure;
+    }
+    writer_flush(&writer);
+    return writer.failed ? JSONFailure : JSONSuccess;
+}
+
+static JSON_Status write_to_fp(void *ctx, const char *data, size_t len) {
+    return fwrite(data, 1, len, (FILE*)ctx) == len ? JSONSuccess : JSONFailure;
+}
+
+JSON_Status json_serialize_to_fp(const JSON_Value *value, FILE *fp, const JSON_Serialize_Options *options) {
+    if (fp == NULL) {
+        return JSONFailure;
+    }
+    return json_serialize_to_stream_ex(value, write_to_fp, fp, options);
+}
+
+#ifdef PARSON_HAS_FD_WRITE
+static JSON_Status write_to_fd(void *ctx, const char *data, size_t len) {
+    int fd = *(const int*)ctx;
+    long written = 0;
+    while (len > 0) {
+#if defined(_WIN32)
+        written = _write(fd, data, (unsigned int)(len > 0x40000000 ? 0x40000000 : len));
+#else
+        written = (long)write(fd, data, len > 0x40000000 ? 0x40000000 : len);
+#endif
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return JSONFailure;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return JSONSuccess;
+}
+#endif
+
+JSON_Status json_serialize_to_fd(const JSON_Value *value, int fd, const JSON_Serialize_Options *options) {
+#ifdef PARSON_HAS_FD_WRITE
+    if (fd < 0) {
+        return JSONFailure;
     }
-    buf = (char*)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
+    return json_serialize_to_stream_ex(value, write_to_fd, &fd, options);
+#else
+    (void)value;
+    (void)fd;
+    (void)options;
+    return JSONFailure;
+#endif
+}
+
+char * json_serialize_to_string_ex(const JSON_Value *value, const JSON_Serialize_Options *options) {
+    JSON_Serialize_Options default_options;
+    JSON_Writer writer;
+    char *result = NULL;
+    if (options == NULL) {
+        json_serialize_options_init(&default_options);
+        options = &default_options;
+    }
+    writer_init(&writer, WRITER_GROWABLE, NULL, 0);
+    writer_set_layout(&writer, options);
+    if (json_serialize_to_writer_r(value, &writer, 0, options, SERIALIZE_CACHE_NONE) != JSONSuccess
+        || writer.failed
+        || !writer_has_room(&writer, 0)) {
+        parson_free(writer.buf);
         return NULL;
     }
-    serialization_result = json_serialize_to_buffer(value, buf, buf_size_bytes);
-    if (serialization_result != JSONSuccess) {
-        json_free_serialized_string(buf);
+    writer.buf[writer.len] = '\0';
+    /* trim unused space, failing to do so is harmless */
+    result = (char*)parson_realloc(writer.buf, writer.capacity, writer.len + 1);
+    return result ? result : writer.buf;
+}
+
+void json_free_serialized_string(char *string) {
+    parson_free(string);
+}
+
+JSON_Iovec * json_serialize_to_iovec(const JSON_Value *value, const JSON_Serialize_Options *options, size_t *count) {
+    JSON_Serialize_Options default_options;
+    JSON_Writer writer;
+    JSON_Iovec *iov = NULL;
+    char *text = NULL;
+    size_t i = 0, n = 0, text_start = 0, max_count = 0;
+    if (count == NULL) {
         return NULL;
     }
-    return buf;
+    if (options == NULL) {
+        json_serialize_options_init(&default_options);
+        options = &default_options;
+    }
+    writer_init(&writer, WRITER_IOVEC, NULL, 0);
+    writer_set_layout(&writer, options);
+    if (json_serialize_to_writer_r(value, &writer, 0, options, SERIALIZE_CACHE_NONE) != JSONSuccess
+        || writer.failed) {
+        goto end;
+    }
+    /* entries and structural text are allocated in one block */
+    max_count = writer.ref_count * 2 + 1;
+    iov = (JSON_Iovec*)parson_malloc(max_count * sizeof(JSON_Iovec) + writer.len);
+    if (iov == NULL) {
+        goto end;
+    }
+    text = (char*)(iov + max_count);
+    if (writer.len > 0) {
+        memcpy(text, writer.buf, writer.len);
+    }
+    for (i = 0; i < writer.ref_count; i++) {
+        if (writer.refs[i].offset > text_start) {
+            iov[n].base = text + text_start;
+            iov[n].len = writer.refs[i].offset - text_start;
+            n++;
+            text_start = writer.refs[i].offset;
+        }
+        iov[n].base = writer.refs[i].data;
+        iov[n].len = writer.refs[i].len;
+        n++;
+    }
+    if (writer.len > text_start) {
+        iov[n].base = text + text_start;
+        iov[n].len = writer.len - text_start;
+        n++;
+    }
+    *count = n;
+end:
+    parson_free(writer.buf);
+    parson_free(writer.refs);
+    return iov;
 }
 
-size_t json_serialization_size_pretty(const JSON_Value *value) {
-    char num_buf[PARSON_NUM_BUF_SIZE]; /* recursively allocating buffer on stack is a bad idea, so let's do it only once */
-    int res = json_serialize_to_buffer_r(value, NULL, 0, PARSON_TRUE, num_buf);
-    return res < 0 ? 0 : (size_t)(res) + 1;
+void json_free_iovec(JSON_Iovec *iov) {
+    parson_free(iov);
 }
 
-JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf, size_t buf_size_in_bytes) {
-    int written = -1;
-    size_t needed_size_in_bytes = json_serialization_size_pretty(value);
-    if (needed_size_in_bytes == 0 || buf_size_in_bytes < needed_size_in_bytes) {
+JSON_Status json_array_reserve(JSON_Array *array, size_t capacity) {
+    if (array == NULL || json_value_is_frozen(json_array_get_wrapping_value(array))) {
         return JSONFailure;
     }
-    written = json_serialize_to_buffer_r(value, buf, 0, PARSON_TRUE, NULL);
-    if (written < 0) {
-        return JSONFailure;
+    if (capacity <= array->capacity) {
+        return JSONSuccess;
     }
-    return JSONSuccess;
+    return json_array_resize(array, capacity);
 }
 
-JSON_Status json_serialize_to_file_pretty(const JSON_Value *value, const char *filename) {
-    JSON_Status return_code = JSONSuccess;
-    FILE *fp = NULL;
-    char *serialized_string = json_serialize_to_string_pretty(value);
-    if (serialized_string == NULL) {
-        return JSONFailure;
-    }
-    fp = fopen(filename, "w");
-    if (fp == NULL) {
-        json_free_serialized_string(serialized_string);
+JSON_Status json_array_pack(JSON_Array *array) {
+    JSON_Array packed;
+    JSON_Value_Type type = JSONError;
+    size_t i = 0;
+    JSON_Status status = JSONFailure;
+    if (array == NULL || array->count == 0 || json_value_is_frozen(json_array_get_wrapping_value(array))) {
         return JSONFailure;
     }
-    if (fputs(serialized_string, fp) == EOF) {
-        return_code = JSONFailure;
+    if (array->packing != ARRAY_BOXED) {
+        return JSONSuccess;
     }
-    if (fclose(fp) == EOF) {
-        return_code = JSONFailure;
+    type = json_value_get_type(array->items[0]);
+    if (type != JSONNumber && type != JSONBoolean) {
+        return JSONFailure;
     }
-    json_free_serialized_string(serialized_string);
-    return return_code;
-}
-
-char * json_serialize_to_string_pretty(const JSON_Value *value) {
-    JSON_Status serialization_result = JSONFailure;
-    size_t buf_size_bytes = json_serialization_size_pretty(value);
-    char *buf = NULL;
-    if (buf_size_bytes == 0) {
-        return NULL;
+    for (i = 1; i < array->count; i++) {
+        if (json_value_get_type(array->items[i]) != type) {
+            return JSONFailure;
+        }
     }
-    buf = (char*)parson_malloc(buf_size_bytes);
-    if (buf == NULL) {
-        return NULL;
+    json_array_init(&packed);
+    packed.packing = type == JSONNumber ? ARRAY_PACKED_NUMBERS : ARRAY_PACKED_BOOLEANS;
+    if (json_array_resize(&packed, array->count) != JSONSuccess) {
+        return JSONFailure;
     }
-    serialization_result = json_serialize_to_buffer_pretty(value, buf, buf_size_bytes);
-    if (serialization_result != JSONSuccess) {
-        json_free_serialized_string(buf);
-        return NULL;
+    for (i = 0; i < array->count; i++) {
+        if (type == JSONNumber) {
+            status = json_array_add_number(&packed, json_value_get_number(array->items[i]));
+        } else {
+            status = json_array_add_boolean(&packed, json_value_get_boolean(array->items[i]));
+        }
+        if (status != JSONSuccess) { /* can't happen, there is enough capacity */
+            json_array_deinit(&packed);
+            return JSONFailure;
+        }
     }
-    return buf;
-}
-
-void json_free_serialized_string(char *string) {
-    parson_free(string);
+    json_array_deinit(array);
+    *array = packed;
+    return JSONSuccess;
 }
 
 JSON_Status json_array_remove(JSON_Array *array, size_t ix) {
-    size_t to_move_bytes = 0;
-    if (array == NULL || ix >= json_array_get_count(array)) {
+    size_t to_move_bytes = 0, i = 0;
+    if (array == NULL || ix >= json_array_get_count(array) || json_value_is_frozen(json_array_get_wrapping_value(array))) {
         return JSONFailure;
     }
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
+    if (array->packing == ARRAY_PACKED_NUMBERS) {
+        to_move_bytes = (array->count - 1 - ix) * sizeof(double);
+        memmove(ARRAY_NUMBERS(array) + ix, ARRAY_NUMBERS(array) + ix + 1, to_move_bytes);
+        array->count -= 1;
+        return JSONSuccess;
+    } else if (array->packing == ARRAY_PACKED_BOOLEANS) {
+        for (i = ix; i + 1 < array->count; i++) {
+            json_array_set_bit(array, i, ARRAY_GET_BIT(array, i + 1));
+        }
+        array->count -= 1;
+        return JSONSuccess;
+    }
     json_value_free(json_array_get_value(array, ix));
     to_move_bytes = (json_array_get_count(array) - 1 - ix) * sizeof(JSON_Value*);
     memmove(array->items + ix, array->items + ix + 1, to_move_bytes);
@@ -1933,11 +4470,16 @@ JSON_Status json_array_remove(JSON_Array *array, size_t ix) {
 }
 
 JSON_Status json_array_replace_value(JSON_Array *array, size_t ix, JSON_Value *value) {
-    if (array == NULL || value == NULL || value->parent != NULL || ix >= json_array_get_count(array)) {
+    if (array == NULL || value == NULL || json_value_has_parent(value) || ix >= json_array_get_count(array)
+        || json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    if (array->packing != ARRAY_BOXED && json_array_unpack(array) != JSONSuccess) {
         return JSONFailure;
     }
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
     json_value_free(json_array_get_value(array, ix));
-    value->parent = json_array_get_wrapping_value(array);
+    json_value_set_parent(value, json_array_get_wrapping_value(array));
     array->items[ix] = value;
     return JSONSuccess;
 }
@@ -1967,7 +4509,19 @@ JSON_Status json_array_replace_string_with_len(JSON_Array *array, size_t i, cons
 }
 
 JSON_Status json_array_replace_number(JSON_Array *array, size_t i, double number) {
-    JSON_Value *value = json_value_init_number(number);
+    JSON_Value *value = NULL;
+    if (json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    if (array && array->packing == ARRAY_PACKED_NUMBERS) {
+        if (i >= array->count || IS_NUMBER_INVALID(number)) {
+            return JSONFailure;
+        }
+        json_value_invalidate_cache(json_array_get_wrapping_value(array));
+        ARRAY_NUMBERS(array)[i] = number;
+        return JSONSuccess;
+    }
+    value = json_value_init_number(number);
     if (value == NULL) {
         return JSONFailure;
     }
@@ -1979,7 +4533,19 @@ JSON_Status json_array_replace_number(JSON_Array *array, size_t i, double number
 }
 
 JSON_Status json_array_replace_boolean(JSON_Array *array, size_t i, int boolean) {
-    JSON_Value *value = json_value_init_boolean(boolean);
+    JSON_Value *value = NULL;
+    if (json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    if (array && array->packing == ARRAY_PACKED_BOOLEANS) {
+        if (i >= array->count) {
+            return JSONFailure;
+        }
+        json_value_invalidate_cache(json_array_get_wrapping_value(array));
+        json_array_set_bit(array, i, boolean);
+        return JSONSuccess;
+    }
+    value = json_value_init_boolean(boolean);
     if (value == NULL) {
         return JSONFailure;
     }
@@ -2004,18 +4570,19 @@ JSON_Status json_array_replace_null(JSON_Array *array, size_t i) {
 
 JSON_Status json_array_clear(JSON_Array *array) {
     size_t i = 0;
-    if (array == NULL) {
+    if (array == NULL || json_value_is_frozen(json_array_get_wrapping_value(array))) {
         return JSONFailure;
     }
-    for (i = 0; i < json_array_get_count(array); i++) {
-        json_value_free(json_array_get_value(array, i));
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
+    for (i = 0; array->packing == ARRAY_BOXED && i < json_array_get_count(array); i++) {
+        json_value_free(array->items[i]);
     }
     array->count = 0;
     return JSONSuccess;
 }
 
 JSON_Status json_array_append_value(JSON_Array *array, JSON_Value *value) {
-    if (array == NULL || value == NULL || value->parent != NULL) {
+    if (array == NULL || value == NULL || json_value_has_parent(value)) {
         return JSONFailure;
     }
     return json_array_add(array, value);
@@ -2046,7 +4613,15 @@ JSON_Status json_array_append_string_with_len(JSON_Array *array, const char *str
 }
 
 JSON_Status json_array_append_number(JSON_Array *array, double number) {
-    JSON_Value *value = json_value_init_number(number);
+    JSON_Value *value = NULL;
+    if (json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    if (array && array->packing == ARRAY_PACKED_NUMBERS) {
+        json_value_invalidate_cache(json_array_get_wrapping_value(array));
+        return json_array_add_number(array, number);
+    }
+    value = json_value_init_number(number);
     if (value == NULL) {
         return JSONFailure;
     }
@@ -2058,7 +4633,15 @@ JSON_Status json_array_append_number(JSON_Array *array, double number) {
 }
 
 JSON_Status json_array_append_boolean(JSON_Array *array, int boolean) {
-    JSON_Value *value = json_value_init_boolean(boolean);
+    JSON_Value *value = NULL;
+    if (json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    if (array && array->packing == ARRAY_PACKED_BOOLEANS) {
+        json_value_invalidate_cache(json_array_get_wrapping_value(array));
+        return json_array_add_boolean(array, boolean);
+    }
+    value = json_value_init_boolean(boolean);
     if (value == NULL) {
         return JSONFailure;
     }
@@ -2081,26 +4664,110 @@ JSON_Status json_array_append_null(JSON_Array *array) {
     return JSONSuccess;
 }
 
+JSON_Status json_array_append_numbers(JSON_Array *array, const double *numbers, size_t count) {
+    JSON_Value *value = NULL;
+    size_t i = 0, initial_count = 0;
+    if (array == NULL || (numbers == NULL && count > 0) || json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
+    if (array->packing == ARRAY_PACKED_NUMBERS) {
+        for (i = 0; i < count; i++) {
+            if (IS_NUMBER_INVALID(numbers[i])) {
+                return JSONFailure;
+            }
+        }
+        if (count == 0) {
+            return JSONSuccess;
+        }
+        if (json_array_reserve_more(array, count) != JSONSuccess) {
+            return JSONFailure;
+        }
+        memcpy(ARRAY_NUMBERS(array) + array->count, numbers, count * sizeof(double));
+        array->count += count;
+        return JSONSuccess;
+    }
+    if (array->packing != ARRAY_BOXED && count > 0 && json_array_unpack(array) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (json_array_reserve_more(array, count) != JSONSuccess) {
+        return JSONFailure;
+    }
+    initial_count = array->count;
+    for (i = 0; i < count; i++) {
+        value = json_value_init_number(numbers[i]);
+        if (value == NULL) {
+            json_array_truncate(array, initial_count);
+            return JSONFailure;
+        }
+        json_value_set_parent(value, json_array_get_wrapping_value(array));
+        array->items[array->count] = value;
+        array->count++;
+    }
+    return JSONSuccess;
+}
+
+JSON_Status json_array_append_strings(JSON_Array *array, const char * const *strings, const size_t *lens, size_t count) {
+    JSON_Value *value = NULL;
+    size_t i = 0, initial_count = 0;
+    if (array == NULL || (strings == NULL && count > 0) || json_value_is_frozen(json_array_get_wrapping_value(array))) {
+        return JSONFailure;
+    }
+    json_value_invalidate_cache(json_array_get_wrapping_value(array));
+    if (array->packing != ARRAY_BOXED && count > 0 && json_array_unpack(array) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (json_array_reserve_more(array, count) != JSONSuccess) {
+        return JSONFailure;
+    }
+    initial_count = array->count;
+    for (i = 0; i < count; i++) {
+        if (strings[i] == NULL) {
+            value = NULL;
+        } else if (lens) {
+            value = json_value_init_string_with_len(strings[i], lens[i]);
+        } else {
+            value = json_value_init_string(strings[i]);
+        }
+        if (value == NULL) {
+            json_array_truncate(array, initial_count);
+            return JSONFailure;
+        }
+        json_value_set_parent(value, json_array_get_wrapping_value(array));
+        array->items[array->count] = value;
+        array->count++;
+    }
+    return JSONSuccess;
+}
+
 JSON_Status json_object_set_value(JSON_Object *object, const char *name, JSON_Value *value) {
-    unsigned long hash = 0;
+    size_t name_len = 0;
+    if (!object || !name || !value || json_value_has_parent(value)) {
+        return JSONFailure;
+    }
+    name_len = strlen(name);
+    return json_object_set_value_with_hash(object, name, name_len, hash_string(name, name_len), value);
+}
+
+static JSON_Status json_object_set_value_with_hash(JSON_Object *object, const char *name, size_t name_len, unsigned long hash, JSON_Value *value) {
     parson_bool_t found = PARSON_FALSE;
     size_t cell_ix = 0;
     size_t item_ix = 0;
     JSON_Value *old_value = NULL;
     char *key_copy = NULL;
 
-    if (!object || !name || !value || value->parent) {
+    if (json_value_is_frozen(json_object_get_wrapping_value(object))) {
         return JSONFailure;
     }
-    hash = hash_string(name, strlen(name));
-    found = PARSON_FALSE;
-    cell_ix = json_object_get_cell_ix(object, name, strlen(name), hash, &found);
+    json_value_invalidate_cache(json_object_get_wrapping_value(object));
+
+    cell_ix = json_object_get_cell_ix(object, name, name_len, hash, &found);
     if (found) {
         item_ix = object->cells[cell_ix];
         old_value = object->values[item_ix];
         json_value_free(old_value);
         object->values[item_ix] = value;
-        value->parent = json_object_get_wrapping_value(object);
+        json_value_set_parent(value, json_object_get_wrapping_value(object));
         return JSONSuccess;
     }
     if (object->count >= object->item_capacity) {
@@ -2108,9 +4775,9 @@ JSON_Status json_object_set_value(JSON_Object *object, const char *name, JSON_Va
         if (res != JSONSuccess) {
             return JSONFailure;
         }
-        cell_ix = json_object_get_cell_ix(object, name, strlen(name), hash, &found);
+        cell_ix = json_object_get_cell_ix(object, name, name_len, hash, &found);
     }
-    key_copy = parson_strdup(name);
+    key_copy = parson_strndup(name, name_len);
     if (!key_copy) {
         return JSONFailure;
     }
@@ -2120,10 +4787,44 @@ JSON_Status json_object_set_value(JSON_Object *object, const char *name, JSON_Va
     object->cell_ixs[object->count] = cell_ix;
     object->hashes[object->count] = hash;
     object->count++;
-    value->parent = json_object_get_wrapping_value(object);
+    json_value_set_parent(value, json_object_get_wrapping_value(object));
     return JSONSuccess;
 }
 
+JSON_Status json_object_set_value_by_key(JSON_Object *object, const JSON_Key *key, JSON_Value *value) {
+    if (!object || !key || !value || json_value_has_parent(value)) {
+        return JSONFailure;
+    }
+    return json_object_set_value_with_hash(object, key->name, key->length, key->hash, value);
+}
+
+JSON_Status json_object_set_string_by_key(JSON_Object *object, const JSON_Key *key, const char *string) {
+    JSON_Value *value = json_value_init_string(string);
+    JSON_Status status = json_object_set_value_by_key(object, key, value);
+    if (status != JSONSuccess) {
+        json_value_free(value);
+    }
+    return status;
+}
+
+JSON_Status json_object_set_number_by_key(JSON_Object *object, const JSON_Key *key, double number) {
+    JSON_Value *value = json_value_init_number(number);
+    JSON_Status status = json_object_set_value_by_key(object, key, value);
+    if (status != JSONSuccess) {
+        json_value_free(value);
+    }
+    return status;
+}
+
+JSON_Status json_object_set_boolean_by_key(JSON_Object *object, const JSON_Key *key, int boolean) {
+    JSON_Value *value = json_value_init_boolean(boolean);
+    JSON_Status status = json_object_set_value_by_key(object, key, value);
+    if (status != JSONSuccess) {
+        json_value_free(value);
+    }
+    return status;
+}
+
 JSON_Status json_object_set_string(JSON_Object *object, const char *name, const char *string) {
     JSON_Value *value = json_value_init_string(string);
     JSON_Status status = json_object_set_value(object, name, value);
@@ -2290,9 +4991,10 @@ JSON_Status json_object_dotremove(JSON_Object *object, const char *name) {
 
 JSON_Status json_object_clear(JSON_Object *object) {
     size_t i = 0;
-    if (object == NULL) {
+    if (object == NULL || json_value_is_frozen(json_object_get_wrapping_value(object))) {
         return JSONFailure;
     }
+    json_value_invalidate_cache(json_object_get_wrapping_value(object));
     for (i = 0; i < json_object_get_count(object); i++) {
         parson_free(object->names[i]);
         object->names[i] = NULL;
@@ -2307,6 +5009,19 @@ JSON_Status json_object_clear(JSON_Object *object) {
     return JSONSuccess;
 }
 
+JSON_Status json_object_reserve(JSON_Object *object, size_t capacity) {
+    if (object == NULL || json_value_is_frozen(json_object_get_wrapping_value(object))) {
+        return JSONFailure;
+    }
+    if (capacity <= object->item_capacity) {
+        return JSONSuccess;
+    }
+    if (capacity > OBJECT_MAX_CAPACITY) {
+        return JSONFailure;
+    }
+    return json_object_rehash(object, json_object_cell_capacity_for(capacity));
+}
+
 JSON_Status json_validate(const JSON_Value *schema, const JSON_Value *value) {
     JSON_Value *temp_schema_value = NULL, *temp_value = NULL;
     JSON_Array *schema_array = NULL, *value_array = NULL;
@@ -2330,6 +5045,16 @@ JSON_Status json_validate(const JSON_Value *schema, const JSON_Value *value) {
             if (count == 0) {
                 return JSONSuccess; /* Empty array allows all types */
             }
+            /* Items of packed arrays are numbers or booleans, so only their types are compared */
+            if (schema_array->packing != ARRAY_BOXED || value_array->packing != ARRAY_BOXED) {
+                schema_type = json_array_get_item_type(schema_array, 0);
+                for (i = 0; i < json_array_get_count(value_array); i++) {
+                    if (schema_type != JSONNull && json_array_get_item_type(value_array, i) != schema_type) {
+                        return JSONFailure;
+                    }
+                }
+                return JSONSuccess;
+            }
             /* Get first value from array, rest is ignored */
             temp_schema_value = json_array_get_value(schema_array, 0);
             for (i = 0; i < json_array_get_count(value_array); i++) {
@@ -2350,8 +5075,8 @@ JSON_Status json_validate(const JSON_Value *schema, const JSON_Value *value) {
             }
             for (i = 0; i < count; i++) {
                 key = json_object_get_name(schema_object, i);
-                temp_schema_value = json_object_get_value(schema_object, key);
-                temp_value = json_object_get_value(value_object, key);
+                temp_schema_value = schema_object->values[i];
+                temp_value = json_object_get_value_with_hash(value_object, key, strlen(key), schema_object->hashes[i]);
                 if (temp_value == NULL) {
                     return JSONFailure;
                 }
@@ -2367,10 +5092,208 @@ JSON_Status json_validate(const JSON_Value *schema, const JSON_Value *value) {
     }
 }
 
-int json_value_equals(const JSON_Value *a, const JSON_Value *b) {
+static void json_schema_measure(const JSON_Value *schema, size_t depth, size_t *op_count, size_t *names_size, size_t *max_depth) {
+    const JSON_Object *object = NULL;
+    const JSON_Array *array = NULL;
+    size_t i = 0;
+    *op_count += 1;
+    switch (json_value_get_type(schema)) {
+        case JSONObject:
+            object = json_value_get_object(schema);
+            if (object->count == 0) {
+                return;
+            }
+            depth++;
+            for (i = 0; i < object->count; i++) {
+                *names_size += strlen(object->names[i]) + 1;
+                json_schema_measure(object->values[i], depth, op_count, names_size, max_depth);
+            }
+            break;
+        case JSONArray:
+            array = json_value_get_array(schema);
+            if (array->count == 0) {
+                return;
+            }
+            depth++;
+            if (array->packing != ARRAY_BOXED) {
+                *op_count += 1;
+            } else {
+                json_schema_measure(array->items[0], depth, op_count, names_size, max_depth);
+            }
+            break;
+        default:
+            return;
+    }
+    if (depth > *max_depth) {
+        *max_depth = depth;
+    }
+}
+
+static size_t json_schema_emit(JSON_Schema_Op *ops, size_t ix, const JSON_Value *schema, char **names) {
+    const JSON_Object *object = NULL;
+    const JSON_Array *array = NULL;
+    size_t op_ix = ix, member_ix = 0, i = 0;
+    ops[op_ix].name = NULL;
+    ops[op_ix].name_len = 0;
+    ops[op_ix].hash = 0;
+    ops[op_ix].count = 0;
+    ops[op_ix].type = json_value_get_type(schema);
+    ix++;
+    if (ops[op_ix].type == JSONObject) {
+        object = json_value_get_object(schema);
+        ops[op_ix].count = object->count;
+        for (i = 0; i < object->count; i++) {
+            member_ix = ix;
+            ix = json_schema_emit(ops, ix, object->values[i], names);
+            ops[member_ix].name_len = strlen(object->names[i]);
+            ops[member_ix].hash = object->hashes[i];
+            memcpy(*names, object->names[i], ops[member_ix].name_len + 1);
+            ops[member_ix].name = *names;
+            *names += ops[member_ix].name_len + 1;
+        }
+    } else if (ops[op_ix].type == JSONArray && json_value_get_array(schema)->count > 0) {
+        array = json_value_get_array(schema);
+        ops[op_ix].count = 1;
+        if (array->packing != ARRAY_BOXED) { /* items are numbers or booleans, so only the type is checked */
+            ops[ix].name = NULL;
+            ops[ix].name_len = 0;
+            ops[ix].hash = 0;
+            ops[ix].count = 0;
+            ops[ix].type = json_array_get_item_type(array, 0);
+            ops[ix].end = ix + 1;
+            ix++;
+        } else {
+            ix = json_schema_emit(ops, ix, array->items[0], names);
+        }
+    }
+    ops[op_ix].end = ix;
+    return ix;
+}
+
+JSON_Schema * json_schema_compile(const JSON_Value *schema) {
+    JSON_Schema *compiled = NULL;
+    size_t op_count = 0, names_size = 0, depth = 0;
+    char *names = NULL;
+    if (schema == NULL) {
+        return NULL;
+    }
+    json_schema_measure(schema, 0, &op_count, &names_size, &depth);
+    compiled = (JSON_Schema*)parson_malloc(sizeof(JSON_Schema));
+    if (compiled == NULL) {
+        return NULL;
+    }
+    compiled->ops = (JSON_Schema_Op*)parson_malloc(op_count * sizeof(JSON_Schema_Op) + names_size);
+    if (compiled->ops == NULL) {
+        parson_free(compiled);
+        return NULL;
+    }
+    compiled->depth = depth;
+    names = (char*)(compiled->ops + op_count);
+    json_schema_emit(compiled->ops, 0, schema, &names);
+    return compiled;
+}
+
+static JSON_Status json_schema_enter(const JSON_Schema *schema, size_t op_ix, const JSON_Value *value, JSON_Schema_Frame *stack, size_t *top) {
+    const JSON_Schema_Op *op = &schema->ops[op_ix];
+    JSON_Value_Type type = json_value_get_type(value);
+    const JSON_Array *array = NULL;
+    int item_type = JSONError;
+    size_t i = 0;
+    if (op->type != JSONNull && op->type != type) {
+        return JSONFailure;
+    }
+    if (op->count == 0) {
+        return JSONSuccess;
+    }
+    if (type == JSONObject) {
+        if (json_object_get_count(json_value_get_object(value)) < op->count) {
+            return JSONFailure;
+        }
+        stack[*top].count = op->count;
+    } else {
+        array = json_value_get_array(value);
+        if (array->packing != ARRAY_BOXED) {
+            item_type = schema->ops[op_ix + 1].type;
+            for (i = 0; i < array->count; i++) {
+                if (item_type != JSONNull && json_array_get_item_type(array, i) != item_type) {
+                    return JSONFailure;
+                }
+            }
+            return JSONSuccess;
+        }
+        stack[*top].count = array->count;
+    }
+    stack[*top].value = value;
+    stack[*top].op = op_ix;
+    stack[*top].next = op_ix + 1;
+    stack[*top].i = 0;
+    *top += 1;
+    return JSONSuccess;
+}
+
+JSON_Status json_schema_check(const JSON_Schema *schema, const JSON_Value *value) {
+    JSON_Schema_Frame stack_buf[PARSON_SCHEMA_STACK_SIZE];
+    JSON_Schema_Frame *stack = stack_buf;
+    JSON_Schema_Frame *frame = NULL;
+    const JSON_Schema_Op *member = NULL;
+    const JSON_Value *item = NULL;
+    JSON_Status status = JSONSuccess;
+    size_t top = 0, op_ix = 0;
+    if (schema == NULL || value == NULL) {
+        return JSONFailure;
+    }
+    if (schema->depth > PARSON_SCHEMA_STACK_SIZE) {
+        stack = (JSON_Schema_Frame*)parson_malloc(schema->depth * sizeof(JSON_Schema_Frame));
+        if (stack == NULL) {
+            return JSONFailure;
+        }
+    }
+    status = json_schema_enter(schema, 0, value, stack, &top);
+    while (status == JSONSuccess && top > 0) {
+        frame = &stack[top - 1];
+        if (frame->i == frame->count) {
+            top--;
+            continue;
+        }
+        frame->i++;
+        if (json_value_get_type(frame->value) == JSONObject) {
+            member = &schema->ops[frame->next];
+            op_ix = frame->next;
+            frame->next = member->end;
+            item = json_object_get_value_with_hash(json_value_get_object(frame->value), member->name, member->name_len, member->hash);
+            if (item == NULL) {
+                status = JSONFailure;
+                break;
+            }
+        } else {
+            op_ix = frame->op + 1; /* only the first item of an array schema is checked against all items */
+            item = json_value_get_array(frame->value)->items[frame->i - 1];
+        }
+        status = json_schema_enter(schema, op_ix, item, stack, &top);
+    }
+    if (stack != stack_buf) {
+        parson_free(stack);
+    }
+    return status;
+}
+
+void json_schema_free(JSON_Schema *schema) {
+    if (schema == NULL) {
+        return;
+    }
+    parson_free(schema->ops);
+    parson_free(schema);
+}
+
+static parson_bool_t json_number_identical(double a, double b) {
+    return memcmp(&a, &b, sizeof(double)) == 0; /* unlike ==, tells -0 from 0 */
+}
+
+/* With exact set values have to serialize the same: numbers have to be identical instead of within EPSILON
+   and keys have to be in the same order (used to share subtrees) */
+static parson_bool_t json_value_equals_r(const JSON_Value *a, const JSON_Value *b, parson_bool_t exact) {
     JSON_Object *a_object = NULL, *b_object = NULL;
     JSON_Array *a_array = NULL, *b_array = NULL;
-    const JSON_String *a_string = NULL, *b_string = NULL;
     const char *key = NULL;
     size_t a_count = 0, b_count = 0, i = 0;
     JSON_Value_Type a_type, b_type;
@@ -2389,8 +5312,7 @@ int json_value_equals(const JSON_Value *a, const JSON_Value *b) {
                 return PARSON_FALSE;
             }
             for (i = 0; i < a_count; i++) {
-                if (!json_value_equals(json_array_get_value(a_array, i),
-                                       json_array_get_value(b_array, i))) {
+                if (!json_array_item_equals(a_array, b_array, i, exact)) {
                     return PARSON_FALSE;
                 }
             }
@@ -2405,23 +5327,26 @@ int json_value_equals(const JSON_Value *a, const JSON_Value *b) {
             }
             for (i = 0; i < a_count; i++) {
                 key = json_object_get_name(a_object, i);
-                if (!json_value_equals(json_object_get_value(a_object, key),
-                                       json_object_get_value(b_object, key))) {
+                if (exact && strcmp(key, json_object_get_name(b_object, i)) != 0) {
+                    return PARSON_FALSE;
+                }
+                if (!json_value_equals_r(json_object_get_value(a_object, key),
+                                         json_object_get_value(b_object, key), exact)) {
                     return PARSON_FALSE;
                 }
             }
             return PARSON_TRUE;
         case JSONString:
-            a_string = json_value_get_string_desc(a);
-            b_string = json_value_get_string_desc(b);
-            if (a_string == NULL || b_string == NULL) {
-                return PARSON_FALSE; /* shouldn't happen */
-            }
-            return a_string->length == b_string->length &&
-                   memcmp(a_string->chars, b_string->chars, a_string->length) == 0;
+            a_count = json_value_get_string_len(a);
+            b_count = json_value_get_string_len(b);
+            return a_count == b_count &&
+                   memcmp(json_value_get_string(a), json_value_get_string(b), a_count) == 0;
         case JSONBoolean:
             return json_value_get_boolean(a) == json_value_get_boolean(b);
         case JSONNumber:
+            if (exact) {
+                return json_number_identical(json_value_get_number(a), json_value_get_number(b));
+            }
             return fabs(json_value_get_number(a) - json_value_get_number(b)) < 0.000001; /* EPSILON */
         case JSONError:
             return PARSON_TRUE;
@@ -2432,6 +5357,15 @@ int json_value_equals(const JSON_Value *a, const JSON_Value *b) {
     }
 }
 
+int json_value_equals(const JSON_Value *a, const JSON_Value *b) {
+    return json_value_equals_r(a, b, PARSON_FALSE);
+}
+
+unsigned long json_value_hash(const JSON_Value *value) {
+    parson_bool_t cached = PARSON_TRUE;
+    return json_value_hash_r(value, PARSON_FALSE, &cached);
+}
+
 JSON_Value_Type json_type(const JSON_Value *value) {
     return json_value_get_type(value);
 }
@@ -2461,8 +5395,70 @@ int json_boolean(const JSON_Value *value) {
 }
 
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun) {
-    parson_malloc = malloc_fun;
-    parson_free = free_fun;
+    JSON_Allocator allocator;
+    json_slab_release();
+    parson_legacy_malloc = malloc_fun;
+    parson_legacy_free = free_fun;
+    allocator.ctx = NULL;
+    allocator.malloc_fun = parson_legacy_malloc_adapter;
+    allocator.realloc_fun = NULL;
+    allocator.free_fun = parson_legacy_free_adapter;
+    parson_allocator = allocator;
+}
+
+void json_set_allocator(const JSON_Allocator *allocator) {
+    json_slab_release();
+    if (allocator == NULL) {
+        parson_allocator.ctx = NULL;
+        parson_allocator.malloc_fun = parson_stdlib_malloc;
+        parson_allocator.realloc_fun = parson_stdlib_realloc;
+        parson_allocator.free_fun = parson_stdlib_free;
+        return;
+    }
+    parson_allocator = *allocator;
+}
+
+void json_set_thread_allocator(const JSON_Allocator *allocator) {
+    if (allocator == NULL) {
+        parson_thread_allocator_set = PARSON_FALSE;
+        return;
+    }
+    parson_thread_allocator = *allocator;
+    parson_thread_allocator_set = PARSON_TRUE;
+}
+
+void json_set_slab_allocation(int enabled) {
+    parson_slab_enabled = enabled ? PARSON_TRUE : PARSON_FALSE;
+}
+
+void json_slab_release(void) {
+    JSON_Slab_Node *node = NULL;
+    int i = 0;
+    for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+        while (parson_slab_free_nodes[i] != NULL) {
+            node = parson_slab_free_nodes[i];
+            parson_slab_free_nodes[i] = node->next;
+            parson_allocator.free_fun(parson_allocator.ctx, node); /* cached values come from the global allocator */
+        }
+        parson_slab_free_count[i] = 0;
+    }
+}
+
+JSON_Status json_set_hash_seed(unsigned long seed_high, unsigned long seed_low) {
+#ifdef PARSON_SEEDED_HASH
+    unsigned int key[2];
+    key[0] = (unsigned int)seed_low;
+    key[1] = (unsigned int)seed_high;
+    if (!PARSON_SEED_CAS(&parson_hash_seed_state, HASH_SEED_UNSET, HASH_SEED_SETTING)) {
+        return JSONFailure;
+    }
+    hash_seed_store(key);
+    return JSONSuccess;
+#else
+    (void)seed_high;
+    (void)seed_low;
+    return JSONFailure;
+#endif
 }
 
 void json_set_escape_slashes(int escape_slashes) {
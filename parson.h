@@ -41,11 +41,14 @@ extern "C"
 #define PARSON_VERSION_STRING "1.5.3"
 
 #include <stddef.h>   /* size_t */
+#include <stdio.h>    /* FILE */
 
 /* Types and enums */
 typedef struct json_object_t JSON_Object;
 typedef struct json_array_t  JSON_Array;
 typedef struct json_value_t  JSON_Value;
+typedef struct json_key_t    JSON_Key;
+typedef struct json_schema_t JSON_Schema;
 
 enum json_value_type {
     JSONError   = -1,
@@ -67,23 +70,106 @@ typedef int JSON_Status;
 typedef void * (*JSON_Malloc_Function)(size_t);
 typedef void   (*JSON_Free_Function)(void *);
 
+/* Allocator with a user context pointer passed to every call. realloc_fun may be null,
+   in which case malloc_fun, memcpy and free_fun are used instead. */
+typedef struct json_allocator_t {
+    void  *ctx;
+    void * (*malloc_fun)(void *ctx, size_t size);
+    void * (*realloc_fun)(void *ctx, void *ptr, size_t size);
+    void   (*free_fun)(void *ctx, void *ptr);
+} JSON_Allocator;
+
 /* A function used for serializing numbers (see json_set_number_serialization_function).
    If 'buf' is null then it should return number of bytes that would've been written 
    (but not more than PARSON_NUM_BUF_SIZE).
 */
 typedef int (*JSON_Number_Serialization_Function)(double num, char *buf);
 
+/* A function receiving output of json_serialize_to_stream in chunks, should return JSONFailure
+   to stop serialization (e.g. when writing fails). */
+typedef JSON_Status (*JSON_Write_Function)(void *ctx, const char *data, size_t len);
+
+/* Part of output of json_serialize_to_iovec (data isn't null terminated) */
+typedef struct json_iovec_t {
+    const char *base;
+    size_t      len;
+} JSON_Iovec;
+
+/* Options for json_serialize_*_ex functions. Initialize with json_serialize_options_init
+   and then change the fields you need. Unlike json_set_escape_slashes and similar functions
+   they only affect a single call, so different threads can use different settings. */
+typedef struct json_serialize_options_t {
+    int pretty;                /* indent output like json_serialize_to_string_pretty, default 0 */
+    int escape_slashes;        /* write '/' as "\/", default 1 */
+    const char *float_format;  /* see json_set_float_serialization_format, default null */
+    JSON_Number_Serialization_Function number_serialization_function; /* default null */
+    const char *indent;        /* written once per nesting level in pretty output, e.g. "  " or "\t",
+                                  default null (PARSON_INDENT_STR, 4 spaces) */
+    const char *newline;       /* line separator in pretty output, e.g. "\r\n", default null ("\n") */
+    int canonical;             /* RFC 8785 (JCS) output, the same bytes for equal values: keys sorted by UTF-16
+                                  code units, shortest numbers laid out like in ECMAScript, only required escapes.
+                                  Ignores all options above. Fails on compilers without a 64-bit integer
+                                  type (needed for shortest numbers). Default 0 */
+} JSON_Serialize_Options;
+
+/* Options for json_parse_*_ex functions, initialize with json_parse_options_init. */
+typedef struct json_parse_options_t {
+    int with_comments;                /* ignore comments (/ * * / and //), default 0 */
+    const JSON_Allocator *allocator;  /* allocator for parsed values, default null (global allocator) */
+    int pack_arrays;                  /* store arrays of only numbers or only booleans packed, default 0
+                                         (see json_array_pack) */
+    int retain_source;                /* keep the input text and write unchanged objects and arrays by copying
+                                         it, so their output keeps the source's spacing, number forms and
+                                         escapes and ignores escape_slashes. Not used for pretty output or a
+                                         custom number format. Changed containers are serialized as usual.
+                                         Default 0 */
+    int dedupe;                       /* share repeated objects and arrays (see json_value_dedupe), default 0 */
+    int intern_strings;               /* store each distinct string value longer than fits inside a value (and
+                                         up to PARSON_INTERN_MAX_LEN, 64 bytes) once, shared by all values
+                                         parsed from it (deep copies get their own), default 0 */
+} JSON_Parse_Options;
+
 /* Call only once, before calling any other function from parson API. If not called, malloc and free
    from stdlib will be used for all allocations */
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun);
 
+/* Same as json_set_allocation_functions, but with a context pointer and optional realloc.
+   The allocator is copied. If allocator is null then malloc, realloc and free from stdlib are used.
+   Both functions return values cached for slab allocation (see json_set_slab_allocation) on the
+   calling thread to the previous allocator, other threads have to call json_slab_release first. */
+void json_set_allocator(const JSON_Allocator *allocator);
+
+/* Sets an allocator used instead of the global one by all calls made on the calling thread,
+   e.g. to keep one request's values in that request's memory pool. The allocator is copied.
+   Pass null to go back to the global allocator. Values must be modified and freed
+   with the same allocator they were created with. */
+void json_set_thread_allocator(const JSON_Allocator *allocator);
+
+/* Enables reuse of values freed with json_value_free. Freed values are kept in per-thread
+   freelists (up to PARSON_SLAB_MAX_FREE_NODES for each value size) and handed out again by
+   json_value_init_* and the parser on the same thread, without calling the allocation functions.
+   Disabled by default. This function sets a global setting and is not thread safe. */
+void json_set_slab_allocation(int enabled);
+
+/* Returns values cached by the calling thread's freelists to the free function.
+   Call it before a thread exits when slab allocation was used on it, and on every thread that used it
+   before the global allocator is changed: cached values are freed with the allocator that is current
+   when they're released, so values cached on other threads would go to the new one. */
+void json_slab_release(void);
+
+/* Sets the seed of the object key hash (two 32-bit halves) instead of the one made from the time,
+   the process id, addresses and the OS random source on first use, e.g. to pass bytes from a
+   stronger source. Fails once a key was hashed or the seed was set, since existing objects
+   depend on it, and in builds with PARSON_DJB2_HASH. Thread safe. */
+JSON_Status json_set_hash_seed(unsigned long seed_high, unsigned long seed_low);
+
 /* Sets if slashes should be escaped or not when serializing JSON. By default slashes are escaped.
  This function sets a global setting and is not thread safe. */
 void json_set_escape_slashes(int escape_slashes);
 
 /* Sets float format used for serialization of numbers.
    Make sure it can't serialize to a string longer than PARSON_NUM_BUF_SIZE.
-   If format is null then the default format is used. */
+   If format is null then the default is used: the shortest representation that parses back to the same number. */
 void json_set_float_serialization_format(const char *format);
 
 /* Sets a function that will be used for serialization of numbers.
@@ -104,9 +190,20 @@ JSON_Value * json_parse_string(const char *string);
     returns NULL in case of error */
 JSON_Value * json_parse_string_with_comments(const char *string);
 
+/* Same as above, but settings are taken from options (can be null for defaults). */
+void         json_parse_options_init(JSON_Parse_Options *options);
+JSON_Value * json_parse_file_ex(const char *filename, const JSON_Parse_Options *options);
+JSON_Value * json_parse_string_ex(const char *string, const JSON_Parse_Options *options);
+
+/* Parses first JSON value in a string using allocator for the returned value,
+   returns NULL in case of error. Free the result with json_value_free_with_allocator.
+   The allocator isn't stored in the value: functions that change it later allocate from the
+   current allocator, so pass the same one to json_set_thread_allocator around such calls. */
+JSON_Value * json_parse_string_with_allocator(const char *string, const JSON_Allocator *allocator);
+
 /* Serialization */
 size_t      json_serialization_size(const JSON_Value *value); /* returns 0 on fail */
-JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes);
+JSON_Status json_serialize_to_buffer(const JSON_Value *value, char *buf, size_t buf_size_in_bytes); /* buf is an empty string on fail */
 JSON_Status json_serialize_to_file(const JSON_Value *value, const char *filename);
 char *      json_serialize_to_string(const JSON_Value *value);
 
@@ -116,11 +213,41 @@ JSON_Status json_serialize_to_buffer_pretty(const JSON_Value *value, char *buf,
 JSON_Status json_serialize_to_file_pretty(const JSON_Value *value, const char *filename);
 char *      json_serialize_to_string_pretty(const JSON_Value *value);
 
+/* Serialization with per-call options (can be null for defaults) instead of global settings */
+void        json_serialize_options_init(JSON_Serialize_Options *options);
+size_t      json_serialization_size_ex(const JSON_Value *value, const JSON_Serialize_Options *options); /* returns 0 on fail */
+JSON_Status json_serialize_to_buffer_ex(const JSON_Value *value, char *buf, size_t buf_size_in_bytes, const JSON_Serialize_Options *options);
+JSON_Status json_serialize_to_file_ex(const JSON_Value *value, const char *filename, const JSON_Serialize_Options *options);
+char *      json_serialize_to_string_ex(const JSON_Value *value, const JSON_Serialize_Options *options);
+
+/* Streaming serialization: output is passed to write_fun through a buffer of PARSON_STREAM_BUF_SIZE
+   bytes, so memory use doesn't depend on the size of the document. Options can be null for defaults.
+   json_serialize_to_fd is only available on POSIX systems and Windows (returns JSONFailure otherwise). */
+JSON_Status json_serialize_to_stream(const JSON_Value *value, JSON_Write_Function write_fun, void *ctx);
+JSON_Status json_serialize_to_stream_ex(const JSON_Value *value, JSON_Write_Function write_fun, void *ctx, const JSON_Serialize_Options *options);
+JSON_Status json_serialize_to_fp(const JSON_Value *value, FILE *fp, const JSON_Serialize_Options *options);
+JSON_Status json_serialize_to_fd(const JSON_Value *value, int fd, const JSON_Serialize_Options *options);
+
+/* Serializes value as a list of count buffers to be written in order (e.g. with writev). Runs of
+   string characters needing no escaping and at least PARSON_IOVEC_MIN_REF_SIZE (256) bytes long (and source
+   text of containers parsed with retain_source) point into value instead of being copied, so the list is valid only until value is changed
+   or freed. Options can be null for defaults. Returns NULL on failure, free with json_free_iovec. */
+JSON_Iovec * json_serialize_to_iovec(const JSON_Value *value, const JSON_Serialize_Options *options, size_t *count);
+void         json_free_iovec(JSON_Iovec *iov);
+
 void        json_free_serialized_string(char *string); /* frees string from json_serialize_to_string and json_serialize_to_string_pretty */
 
 /* Comparing */
 int  json_value_equals(const JSON_Value *a, const JSON_Value *b);
 
+/* Structural hash: values equal by json_value_equals have equal hashes, except numbers that differ by
+   less than its epsilon, which usually don't. Order of object keys doesn't matter. Containers with
+   json_value_set_hash_cache enabled keep their hash until changed, so it's O(1) to get again.
+   Hashes use the key hash of objects, so they differ between builds and, with the default seeded key
+   hash, between runs. Define PARSON_HASH_SEED (a fixed seed) or PARSON_DJB2_HASH when building parson.c
+   to get the same hashes in every run. */
+unsigned long json_value_hash(const JSON_Value *value);
+
 /* Validation
    This is *NOT* JSON Schema. It validates json by checking if object have identically
    named fields with matching types.
@@ -133,6 +260,14 @@ int  json_value_equals(const JSON_Value *a, const JSON_Value *b);
  */
 JSON_Status json_validate(const JSON_Value *schema, const JSON_Value *value);
 
+/* Compiles a schema for json_validate into a flat program with the key hashes computed
+   up front, for validating many values against the same schema. json_schema_check
+   gives the same result as json_validate with the original schema, which can be freed
+   or changed after compiling. Returns NULL on failure, free with json_schema_free. */
+JSON_Schema * json_schema_compile(const JSON_Value *schema);
+JSON_Status   json_schema_check(const JSON_Schema *schema, const JSON_Value *value);
+void          json_schema_free(JSON_Schema *schema);
+
 /*
  * JSON Object
  */
@@ -144,6 +279,23 @@ JSON_Array  * json_object_get_array  (const JSON_Object *object, const char *nam
 double        json_object_get_number (const JSON_Object *object, const char *name); /* returns 0 on fail */
 int           json_object_get_boolean(const JSON_Object *object, const char *name); /* returns -1 on fail */
 
+/* Precomputed keys
+ * JSON_Key stores a copy of a name together with its length and hash, so it can be created once
+ * and used for repeated lookups without hashing the same name every time.
+ * Keys aren't bound to any object and can be freed at any time. */
+JSON_Key    * json_key_make(const char *name); /* copies passed name, returns NULL in case of error */
+void          json_key_free(JSON_Key *key);
+const char  * json_key_get_name(const JSON_Key *key);
+
+JSON_Value  * json_object_get_value_by_key  (const JSON_Object *object, const JSON_Key *key);
+const char  * json_object_get_string_by_key (const JSON_Object *object, const JSON_Key *key);
+size_t        json_object_get_string_len_by_key(const JSON_Object *object, const JSON_Key *key); /* doesn't account for last null character */
+JSON_Object * json_object_get_object_by_key (const JSON_Object *object, const JSON_Key *key);
+JSON_Array  * json_object_get_array_by_key  (const JSON_Object *object, const JSON_Key *key);
+double        json_object_get_number_by_key (const JSON_Object *object, const JSON_Key *key); /* returns 0 on fail */
+int           json_object_get_boolean_by_key(const JSON_Object *object, const JSON_Key *key); /* returns -1 on fail */
+int           json_object_has_value_by_key  (const JSON_Object *object, const JSON_Key *key);
+
 /* dotget functions enable addressing values with dot notation in nested objects,
  just like in structs or c++/java/c# objects (e.g. objectA.objectB.value).
  Because valid names in JSON can contain dots, some values may be inaccessible
@@ -179,6 +331,12 @@ JSON_Status json_object_set_number(JSON_Object *object, const char *name, double
 JSON_Status json_object_set_boolean(JSON_Object *object, const char *name, int boolean);
 JSON_Status json_object_set_null(JSON_Object *object, const char *name);
 
+/* Same as above, but using precomputed keys. */
+JSON_Status json_object_set_value_by_key(JSON_Object *object, const JSON_Key *key, JSON_Value *value);
+JSON_Status json_object_set_string_by_key(JSON_Object *object, const JSON_Key *key, const char *string);
+JSON_Status json_object_set_number_by_key(JSON_Object *object, const JSON_Key *key, double number);
+JSON_Status json_object_set_boolean_by_key(JSON_Object *object, const JSON_Key *key, int boolean);
+
 /* Works like dotget functions, but creates whole hierarchy if necessary.
  * json_object_dotset_value does not copy passed value so it shouldn't be freed afterwards. */
 JSON_Status json_object_dotset_value(JSON_Object *object, const char *name, JSON_Value *value);
@@ -197,9 +355,14 @@ JSON_Status json_object_dotremove(JSON_Object *object, const char *key);
 /* Removes all name-value pairs in object */
 JSON_Status json_object_clear(JSON_Object *object);
 
+/* Makes room for at least capacity name-value pairs, so adding them won't rehash */
+JSON_Status json_object_reserve(JSON_Object *object, size_t capacity);
+
 /*
  *JSON Array
  */
+/* Returns NULL for items of packed arrays (see json_array_pack), which have no JSON_Value:
+   read them with the typed getters below or call json_array_unpack first. */
 JSON_Value  * json_array_get_value  (const JSON_Array *array, size_t index);
 const char  * json_array_get_string (const JSON_Array *array, size_t index);
 size_t        json_array_get_string_len(const JSON_Array *array, size_t index); /* doesn't account for last null character */
@@ -207,6 +370,7 @@ JSON_Object * json_array_get_object (const JSON_Array *array, size_t index);
 JSON_Array  * json_array_get_array  (const JSON_Array *array, size_t index);
 double        json_array_get_number (const JSON_Array *array, size_t index); /* returns 0 on fail */
 int           json_array_get_boolean(const JSON_Array *array, size_t index); /* returns -1 on fail */
+JSON_Value_Type json_array_get_item_type(const JSON_Array *array, size_t index); /* returns JSONError on fail */
 size_t        json_array_get_count  (const JSON_Array *array);
 JSON_Value  * json_array_get_wrapping_value(const JSON_Array *array);
 
@@ -227,6 +391,23 @@ JSON_Status json_array_replace_null(JSON_Array *array, size_t i);
 /* Frees and removes all values from array */
 JSON_Status json_array_clear(JSON_Array *array);
 
+/* Makes room for at least capacity items, so appending them won't allocate */
+JSON_Status json_array_reserve(JSON_Array *array, size_t capacity);
+
+/* Stores an array of only numbers or only booleans as a contiguous double[] or a bitset,
+   without a JSON_Value per item. Appending or replacing items of the same type keeps it packed,
+   the first item of another type converts it back. Packed items are read with json_array_get_number,
+   _get_boolean and json_array_get_item_type, json_array_get_value returns NULL for them.
+   Fails for empty arrays and arrays with other items. */
+JSON_Status json_array_pack(JSON_Array *array);
+
+/* Converts a packed array back to a value per item, so json_array_get_value works for its items.
+   Invalidates pointers returned by json_array_get_numbers. Does nothing for other arrays. */
+JSON_Status json_array_unpack(JSON_Array *array);
+
+/* Returns items of an array packed with numbers, or null for other arrays */
+const double * json_array_get_numbers(const JSON_Array *array);
+
 /* Appends new value at the end of array.
  * json_array_append_value does not copy passed value so it shouldn't be freed afterwards. */
 JSON_Status json_array_append_value(JSON_Array *array, JSON_Value *value);
@@ -236,11 +417,19 @@ JSON_Status json_array_append_number(JSON_Array *array, double number);
 JSON_Status json_array_append_boolean(JSON_Array *array, int boolean);
 JSON_Status json_array_append_null(JSON_Array *array);
 
+/* Appends count numbers or strings at once. If lens is null strings have to be null-terminated.
+   Either all values are appended or, in case of failure, none. */
+JSON_Status json_array_append_numbers(JSON_Array *array, const double *numbers, size_t count);
+JSON_Status json_array_append_strings(JSON_Array *array, const char * const *strings, const size_t *lens, size_t count);
+
 /*
  *JSON Value
  */
 JSON_Value * json_value_init_object (void);
 JSON_Value * json_value_init_array  (void);
+JSON_Value * json_value_init_object_with_capacity(size_t capacity); /* room for capacity items without growing */
+JSON_Value * json_value_init_array_with_capacity (size_t capacity);
+JSON_Value * json_value_init_array_from_numbers(const double *numbers, size_t count); /* packed, see json_array_pack */
 JSON_Value * json_value_init_string (const char *string); /* copies passed string */
 JSON_Value * json_value_init_string_with_len(const char *string, size_t length); /* copies passed string, length shouldn't include last null character */
 JSON_Value * json_value_init_number (double number);
@@ -248,6 +437,32 @@ JSON_Value * json_value_init_boolean(int boolean);
 JSON_Value * json_value_init_null   (void);
 JSON_Value * json_value_deep_copy   (const JSON_Value *value);
 void         json_value_free        (JSON_Value *value);
+void         json_value_free_with_allocator(JSON_Value *value, const JSON_Allocator *allocator);
+
+/* Releases unused capacity of all arrays and objects in value, e.g. after building it */
+JSON_Status  json_value_shrink_to_fit(JSON_Value *value);
+
+/* Keeps serialized output of an object or array, and of every container inside it, so serializing it
+   again only walks containers changed since (by json_object_set_*, json_array_*, json_object_dotset_*, ...)
+   and copies the rest. Cached output is used only if no custom float format or number serialization
+   function is set. Disabling frees the caches. Not available with PARSON_COMPACT_VALUES (returns JSONFailure).
+   Serializing fills the caches, so it changes the value even though it's passed as const: don't serialize
+   a value with caches enabled from several threads at the same time. */
+JSON_Status  json_value_set_serialization_cache(JSON_Value *value, int enabled);
+
+/* Keeps json_value_hash of an object or array, and of every container inside it, until they're
+   changed. Disabling stops storing hashes. Not available with PARSON_COMPACT_VALUES (returns JSONFailure).
+   As with the serialization cache, json_value_hash then stores hashes, so don't call it from several
+   threads at the same time for the same value. */
+JSON_Status  json_value_set_hash_cache(JSON_Value *value, int enabled);
+
+/* Replaces objects and arrays inside value that are equal (with exactly equal numbers) to another one
+   inside it with that one, so each repeated subtree is stored once. Shared subtrees are reference
+   counted and frozen: functions changing or reserving capacity in them fail (json_value_shrink_to_fit
+   skips them), json_value_get_parent of a shared value returns NULL, and it's freed with the last of
+   its parents. Values outside them stay changeable.
+   Not available with PARSON_COMPACT_VALUES (returns JSONFailure). */
+JSON_Status  json_value_dedupe(JSON_Value *value);
 
 JSON_Value_Type json_value_get_type   (const JSON_Value *value);
 JSON_Object *   json_value_get_object (const JSON_Value *value);
@@ -256,7 +471,7 @@ const char  *   json_value_get_string (const JSON_Value *value);
 size_t          json_value_get_string_len(const JSON_Value *value); /* doesn't account for last null character */
 double          json_value_get_number (const JSON_Value *value);
 int             json_value_get_boolean(const JSON_Value *value);
-JSON_Value  *   json_value_get_parent (const JSON_Value *value);
+JSON_Value  *   json_value_get_parent (const JSON_Value *value); /* always returns NULL if compiled with PARSON_COMPACT_VALUES */
 
 /* Same as above, but shorter */
 JSON_Value_Type json_type   (const JSON_Value *value);
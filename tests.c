@@ -69,6 +69,30 @@ void test_failing_allocations(void);
 void test_custom_number_format(void);
 void test_custom_number_serialization_function(void);
 void test_object_clear(void);
+void test_object_many_keys(void);
+void test_object_keys(void);
+void test_short_strings(void);
+void test_container_allocations(void);
+void test_slab_allocation(void);
+void test_custom_allocator(void);
+void test_options(void);
+void test_reserve(void);
+void test_bulk_append(void);
+void test_packed_arrays(void);
+void test_single_pass_serialization(void);
+void test_stream_serialization(void);
+void test_shortest_numbers(void);
+void test_string_escaping(void);
+void test_serialization_cache(void);
+void test_retained_source(void);
+void test_pretty_layout(void);
+void test_iovec_serialization(void);
+void test_large_outputs(void);
+void test_value_hash(void);
+void test_dedupe(void);
+void test_interned_strings(void);
+void test_canonical_serialization(void);
+void test_compiled_schema(void);
 
 void print_commits_info(const char *username, const char *repo);
 void persistence_example(void);
@@ -86,6 +110,7 @@ typedef struct failing_alloc {
     int total_count;
     int has_failed;
     int should_fail;
+    int fail_once; /* only allocation_to_fail fails, not the ones after it */
 } failing_alloc_t;
 
 static failing_alloc_t g_failing_alloc;
@@ -93,6 +118,16 @@ static failing_alloc_t g_failing_alloc;
 static void *failing_malloc(size_t size);
 static void failing_free(void *ptr);
 
+typedef struct pool_stats {
+    int live;
+    int mallocs;
+    int reallocs;
+} pool_stats_t;
+
+static void *pool_malloc(void *ctx, size_t size);
+static void *pool_realloc(void *ctx, void *ptr, size_t size);
+static void pool_free(void *ctx, void *ptr);
+
 static char * read_file(const char * filename);
 const char* get_file_path(const char *filename);
 
@@ -140,6 +175,30 @@ int tests_main(int argc, char *argv[]) {
     test_custom_number_format();
     test_custom_number_serialization_function();
     test_object_clear();
+    test_object_many_keys();
+    test_object_keys();
+    test_short_strings();
+    test_container_allocations();
+    test_slab_allocation();
+    test_custom_allocator();
+    test_options();
+    test_reserve();
+    test_bulk_append();
+    test_packed_arrays();
+    test_single_pass_serialization();
+    test_stream_serialization();
+    test_shortest_numbers();
+    test_string_escaping();
+    test_serialization_cache();
+    test_retained_source();
+    test_pretty_layout();
+    test_iovec_serialization();
+    test_large_outputs();
+    test_value_hash();
+    test_dedupe();
+    test_interned_strings();
+    test_canonical_serialization();
+    test_compiled_schema();
 
     printf("Tests failed: %d\n", g_tests_failed);
     printf("Tests passed: %d\n", g_tests_passed);
@@ -282,7 +341,9 @@ void test_suite_2(JSON_Value *root_value) {
     array = json_object_get_array(root_object, "string array");
     array_value = json_object_get_value(root_object, "string array");
     TEST(json_array_get_wrapping_value(array) == array_value);
+#ifndef PARSON_COMPACT_VALUES
     TEST(json_value_get_parent(array_value) == root_value);
+#endif
     TEST(json_value_get_parent(root_value) == NULL);
 }
 
@@ -756,6 +817,1295 @@ void test_object_clear(void) {
     TEST(g_malloc_count == 0);
 }
 
+void test_object_many_keys(void) {
+    g_malloc_count = 0;
+    {
+        JSON_Value *val = json_value_init_object();
+        JSON_Object *obj = json_value_get_object(val);
+        char key[64];
+        int i = 0;
+        int all_found = 1;
+        for (i = 0; i < 1000; i++) {
+            /* long keys with a shared prefix, hashed in several 4 byte blocks */
+            sprintf(key, "some/long/shared/prefix/%d", i);
+            json_object_set_number(obj, key, i);
+        }
+        TEST(json_object_get_count(obj) == 1000);
+        for (i = 0; i < 1000; i++) {
+            sprintf(key, "some/long/shared/prefix/%d", i);
+            if (json_object_get_number(obj, key) != i) {
+                all_found = 0;
+            }
+        }
+        TEST(all_found);
+        TEST(json_object_get_value(obj, "some/long/shared/prefix/1000") == NULL);
+        TEST(json_object_get_value(obj, "some/long/shared/prefix/") == NULL);
+        for (i = 0; i < 1000; i += 2) {
+            sprintf(key, "some/long/shared/prefix/%d", i);
+            json_object_remove(obj, key);
+        }
+        TEST(json_object_get_count(obj) == 500);
+        TEST(json_object_get_value(obj, "some/long/shared/prefix/10") == NULL);
+        TEST(DBL_EQ(json_object_get_number(obj, "some/long/shared/prefix/11"), 11));
+        json_value_free(val);
+    }
+    TEST(g_malloc_count == 0);
+}
+
+void test_object_keys(void) {
+    g_malloc_count = 0;
+    {
+        JSON_Value *val = json_parse_string("{\"timestamp\":123,\"name\":\"lorem\",\"flag\":true,\"nested\":{\"timestamp\":1}}");
+        JSON_Object *obj = json_value_get_object(val);
+        JSON_Key *timestamp_key = json_key_make("timestamp");
+        JSON_Key *name_key = json_key_make("name");
+        JSON_Key *flag_key = json_key_make("flag");
+        JSON_Key *nested_key = json_key_make("nested");
+        JSON_Key *missing_key = json_key_make("times");
+        TEST(json_key_make(NULL) == NULL);
+        TEST(STREQ(json_key_get_name(timestamp_key), "timestamp"));
+        TEST(DBL_EQ(json_object_get_number_by_key(obj, timestamp_key), 123));
+        TEST(STREQ(json_object_get_string_by_key(obj, name_key), "lorem"));
+        TEST(json_object_get_string_len_by_key(obj, name_key) == 5);
+        TEST(json_object_get_boolean_by_key(obj, flag_key) == 1);
+        TEST(DBL_EQ(json_object_get_number_by_key(json_object_get_object_by_key(obj, nested_key), timestamp_key), 1));
+        TEST(json_object_get_array_by_key(obj, nested_key) == NULL);
+        TEST(json_object_get_value_by_key(obj, missing_key) == NULL);
+        TEST(!json_object_has_value_by_key(obj, missing_key));
+        TEST(json_object_get_value_by_key(NULL, timestamp_key) == NULL);
+        TEST(json_object_get_value_by_key(obj, NULL) == NULL);
+
+        TEST(json_object_set_number_by_key(obj, timestamp_key, 456) == JSONSuccess);
+        TEST(DBL_EQ(json_object_get_number(obj, "timestamp"), 456));
+        TEST(json_object_set_string_by_key(obj, missing_key, "ipsum") == JSONSuccess);
+        TEST(STREQ(json_object_get_string(obj, "times"), "ipsum"));
+        TEST(json_object_set_boolean_by_key(obj, flag_key, 0) == JSONSuccess);
+        TEST(json_object_get_boolean(obj, "flag") == 0);
+        TEST(json_object_set_value_by_key(obj, NULL, NULL) == JSONFailure);
+        TEST(json_object_get_count(obj) == 5);
+
+        json_key_free(timestamp_key);
+        json_key_free(name_key);
+        json_key_free(flag_key);
+        json_key_free(nested_key);
+        json_key_free(missing_key);
+        json_value_free(val);
+    }
+    TEST(g_malloc_count == 0);
+}
+
+void test_short_strings(void) {
+    const char *long_string = "a string that is too long to be stored inside of a value";
+    g_malloc_count = 0;
+    {
+        JSON_Value *short_val = NULL, *long_val = NULL, *copy = NULL, *parsed = NULL;
+
+        short_val = json_value_init_string("ok");
+        TEST(g_malloc_count == 1); /* only the value itself */
+        TEST(STREQ(json_value_get_string(short_val), "ok"));
+        TEST(json_value_get_string_len(short_val) == 2);
+
+        long_val = json_value_init_string(long_string);
+        TEST(g_malloc_count == 3);
+        TEST(STREQ(json_value_get_string(long_val), long_string));
+        TEST(json_value_get_string_len(long_val) == strlen(long_string));
+        TEST(!json_value_equals(short_val, long_val));
+
+        copy = json_value_deep_copy(short_val);
+        TEST(g_malloc_count == 4);
+        TEST(json_value_equals(short_val, copy));
+        TEST(json_value_get_string(copy) != json_value_get_string(short_val));
+        json_value_free(copy);
+
+        copy = json_value_init_string_with_len("a\0b", 3);
+        TEST(json_value_get_string_len(copy) == 3);
+        TEST(memcmp(json_value_get_string(copy), "a\0b", 4) == 0);
+        json_value_free(copy);
+
+        parsed = json_parse_string("[\"ok\", \"\\u0041\\u00A2\", \"\", \"a string that is too long to be stored inside of a value\"]");
+        TEST(STREQ(json_array_get_string(json_array(parsed), 0), "ok"));
+        TEST(STREQ(json_array_get_string(json_array(parsed), 1), "A¢"));
+        TEST(json_array_get_string_len(json_array(parsed), 1) == 3);
+        TEST(STREQ(json_array_get_string(json_array(parsed), 2), ""));
+        TEST(STREQ(json_array_get_string(json_array(parsed), 3), long_string));
+        TEST(json_parse_string("\"\\x\"") == NULL);
+        TEST(json_parse_string("[\"\\u00\"]") == NULL);
+
+        json_value_free(parsed);
+        json_value_free(short_val);
+        json_value_free(long_val);
+    }
+    TEST(g_malloc_count == 0);
+}
+
+void test_container_allocations(void) {
+    g_malloc_count = 0;
+    {
+        JSON_Value *obj_val = NULL, *arr_val = NULL;
+        JSON_Object *obj = NULL;
+        JSON_Array *arr = NULL;
+        char key[32];
+        int i = 0;
+
+        obj_val = json_value_init_object();
+        TEST(g_malloc_count == 1); /* header is stored with the value */
+        arr_val = json_value_init_array();
+        TEST(g_malloc_count == 2);
+
+        obj = json_value_get_object(obj_val);
+        arr = json_value_get_array(arr_val);
+        TEST(json_object_get_wrapping_value(obj) == obj_val);
+        TEST(json_array_get_wrapping_value(arr) == arr_val);
+
+        for (i = 0; i < 100; i++) {
+            sprintf(key, "key%d", i);
+            TEST(json_object_set_number(obj, key, i) == JSONSuccess);
+        }
+        for (i = 0; i < 100; i++) {
+            sprintf(key, "key%d", i);
+            TEST(json_object_get_number(obj, key) == i);
+        }
+        TEST(json_object_get_wrapping_value(obj) == obj_val);
+
+        TEST(json_object_set_value(obj, "array", arr_val) == JSONSuccess);
+#ifndef PARSON_COMPACT_VALUES
+        TEST(json_value_get_parent(arr_val) == obj_val);
+#endif
+        TEST(json_object_get_array(obj, "array") == arr);
+        json_value_free(obj_val);
+    }
+    TEST(g_malloc_count == 0);
+}
+
+void test_slab_allocation(void) {
+    JSON_Value *val = NULL, *first = NULL;
+    const char *json = "{\"a\":[1,2,{\"b\":null}],\"c\":\"a string that is too long to be stored inside of a value\"}";
+    int malloc_count = 0;
+
+    json_set_slab_allocation(1);
+    g_malloc_count = 0;
+
+    first = json_parse_string(json);
+    malloc_count = g_malloc_count;
+    json_value_free(first);
+    TEST(g_malloc_count > 0); /* freed values are kept for reuse */
+
+    val = json_parse_string(json);
+    TEST(g_malloc_count == malloc_count); /* all values taken from freelists */
+    TEST(STREQ(json_object_dotget_string(json_object(val), "c"), "a string that is too long to be stored inside of a value"));
+    TEST(json_array_get_count(json_object_get_array(json_object(val), "a")) == 3);
+    json_value_free(val);
+
+    json_slab_release();
+    TEST(g_malloc_count == 0);
+
+    json_set_slab_allocation(0);
+    val = json_value_init_null();
+    json_value_free(val);
+    TEST(g_malloc_count == 0);
+}
+
+void test_custom_allocator(void) {
+    pool_stats_t stats_a = { 0, 0, 0 }, stats_b = { 0, 0, 0 };
+    JSON_Allocator pool_a, pool_b;
+    int mallocs = 0;
+    JSON_Value *val_a = NULL, *val_b = NULL;
+    const char *json = "[1, 2, 3, \"a string that is too long to be stored inside of a value\\n\", [true, false]]";
+
+    pool_a.ctx = &stats_a;
+    pool_a.malloc_fun = pool_malloc;
+    pool_a.realloc_fun = pool_realloc;
+    pool_a.free_fun = pool_free;
+    pool_b = pool_a;
+    pool_b.ctx = &stats_b;
+    pool_b.realloc_fun = NULL;
+
+    g_malloc_count = 0;
+    val_a = json_parse_string_with_allocator(json, &pool_a);
+    val_b = json_parse_string_with_allocator(json, &pool_b);
+    TEST(g_malloc_count == 0); /* nothing went through the global allocator */
+    TEST(stats_a.live > 0 && stats_a.reallocs > 0);
+    TEST(stats_b.live == stats_a.live && stats_b.reallocs == 0);
+    TEST(json_value_equals(val_a, val_b));
+    TEST(json_array_get_string_len(json_array(val_a), 3) == 57);
+
+    /* later changes allocate from the thread allocator, so set the same one before making them */
+    mallocs = stats_a.mallocs;
+    json_set_thread_allocator(&pool_a);
+    TEST(json_array_append_number(json_array(val_a), 4) == JSONSuccess);
+    TEST(json_array_append_string(json_array(val_a), "another string that is too long to be stored inside") == JSONSuccess);
+    TEST(json_array_append_value(json_array(val_a), json_parse_string("{\"a\": [1, 2], \"b\": \"c\"}")) == JSONSuccess);
+    json_set_thread_allocator(NULL);
+    TEST(stats_a.mallocs > mallocs);
+    TEST(g_malloc_count == 0);
+
+    json_value_free_with_allocator(val_a, &pool_a);
+    json_value_free_with_allocator(val_b, &pool_b);
+    TEST(stats_a.live == 0);
+    TEST(stats_b.live == 0);
+    TEST(g_malloc_count == 0);
+
+    json_set_allocator(&pool_a);
+    val_a = json_parse_string(json);
+    TEST(stats_a.live > 0);
+    json_value_free(val_a);
+    TEST(stats_a.live == 0);
+    json_set_allocator(NULL);
+    json_set_allocation_functions(counted_malloc, counted_free);
+}
+
+void test_options(void) {
+    JSON_Serialize_Options ser_options;
+    JSON_Parse_Options parse_options;
+    JSON_Value *val = NULL;
+    char *serialized = NULL;
+    char buf[64];
+
+    g_malloc_count = 0;
+    json_parse_options_init(&parse_options);
+    parse_options.with_comments = 1;
+    val = json_parse_string_ex("[\"a/b\", /* comment */ 0.6]", &parse_options);
+    TEST(json_array_get_count(json_array(val)) == 2);
+    TEST(json_parse_string_ex("[\"a/b\", /* comment */ 0.6]", NULL) == NULL);
+    json_value_free(val);
+    /* a UTF-8 BOM is skipped with comments too (json_parse_string_with_comments used not to) */
+    val = json_parse_string_with_comments("\xEF\xBB\xBF/* comment */ [1]");
+    TEST(json_array_get_number(json_array(val), 0) == 1);
+    json_value_free(val);
+    val = json_parse_string_ex("[\"a/b\", /* comment */ 0.6]", &parse_options);
+
+    json_serialize_options_init(&ser_options);
+    serialized = json_serialize_to_string_ex(val, &ser_options);
+    TEST(STREQ(serialized, "[\"a\\/b\",0.6]"));
+    json_free_serialized_string(serialized);
+
+    ser_options.escape_slashes = 0;
+    ser_options.float_format = "%.3f";
+    TEST(json_serialization_size_ex(val, &ser_options) == 14);
+    TEST(json_serialize_to_buffer_ex(val, buf, 13, &ser_options) == JSONFailure);
+    TEST(json_serialize_to_buffer_ex(val, buf, sizeof(buf), &ser_options) == JSONSuccess);
+    TEST(strcmp(buf, "[\"a/b\",0.600]") == 0);
+
+    ser_options.pretty = 1;
+    ser_options.number_serialization_function = custom_serialization_func;
+    serialized = json_serialize_to_string_ex(val, &ser_options);
+    TEST(STREQ(serialized, "[\n    \"a/b\",\n    0.6\n]"));
+    json_free_serialized_string(serialized);
+
+    /* global settings are not used by _ex functions */
+    json_set_escape_slashes(0);
+    serialized = json_serialize_to_string_ex(val, NULL);
+    TEST(STREQ(serialized, "[\"a\\/b\",0.6]"));
+    json_free_serialized_string(serialized);
+    json_set_escape_slashes(1);
+
+    json_value_free(val);
+    TEST(g_malloc_count == 0);
+}
+
+void test_reserve(void) {
+    JSON_Value *root_val = NULL, *arr_val = NULL;
+    JSON_Object *root = NULL;
+    JSON_Array *arr = NULL;
+    pool_stats_t stats = { 0, 0, 0 };
+    JSON_Allocator pool;
+    char key[32];
+    int i = 0, malloc_count = 0;
+    double number = 0;
+
+    g_malloc_count = 0;
+    arr_val = json_value_init_array_with_capacity(1000);
+    arr = json_value_get_array(arr_val);
+    TEST(g_malloc_count == 2);
+    for (i = 0; i < 1000; i++) {
+        json_array_append_null(arr);
+    }
+    TEST(g_malloc_count == 1002); /* no reallocations */
+    TEST(json_array_reserve(arr, 10) == JSONSuccess);
+    TEST(json_array_reserve(NULL, 10) == JSONFailure);
+
+    root_val = json_value_init_object_with_capacity(100);
+    root = json_value_get_object(root_val);
+    malloc_count = g_malloc_count;
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "%d", i);
+        json_object_set_boolean(root, key, i % 2);
+    }
+    TEST(g_malloc_count == malloc_count + 200); /* a value and a name per item */
+    TEST(json_object_reserve(root, 1000) == JSONSuccess);
+    TEST(json_object_reserve(root, (size_t)-1) == JSONFailure);
+    TEST(json_object_reserve(root, (size_t)-1 / 8) == JSONFailure);
+    TEST(json_value_init_object_with_capacity((size_t)-1) == NULL);
+    for (i = 0; i < 100; i++) {
+        sprintf(key, "%d", i);
+        TEST(json_object_get_boolean(root, key) == i % 2);
+    }
+    json_object_set_value(root, "arr", arr_val);
+    json_object_set_value(root, "empty", json_value_init_array_with_capacity(10));
+    TEST(json_value_shrink_to_fit(root_val) == JSONSuccess);
+    TEST(json_object_get_count(root) == 102);
+    TEST(json_object_get_boolean(root, "99") == 1);
+    TEST(json_array_get_count(arr) == 1000);
+    TEST(json_object_set_null(root, "new") == JSONSuccess);
+    TEST(json_array_append_null(json_object_get_array(root, "empty")) == JSONSuccess);
+    json_value_free(root_val);
+    TEST(g_malloc_count == 0);
+
+    /* repeated bulk appends grow the array geometrically */
+    pool.ctx = &stats;
+    pool.malloc_fun = pool_malloc;
+    pool.realloc_fun = pool_realloc;
+    pool.free_fun = pool_free;
+    json_set_thread_allocator(&pool);
+    arr_val = json_value_init_array();
+    for (i = 0; i < 1000; i++) {
+        number = i;
+        json_array_append_numbers(json_value_get_array(arr_val), &number, 1);
+    }
+    TEST(json_array_get_count(json_value_get_array(arr_val)) == 1000);
+    TEST(stats.reallocs < 20);
+    json_value_free(arr_val);
+    json_set_thread_allocator(NULL);
+    TEST(stats.live == 0);
+}
+
+void test_bulk_append(void) {
+    const double numbers[] = { 1.0, 2.5, -3.0 };
+    const char *strings[] = { "a", "b\0c", "a string that is too long to be stored inside of a value" };
+    const size_t lens[] = { 1, 3, 56 };
+    double bad_numbers[2];
+    JSON_Value *val = NULL;
+    JSON_Array *arr = NULL;
+    char *serialized = NULL;
+
+    g_malloc_count = 0;
+    val = json_value_init_array_from_numbers(numbers, 3);
+    arr = json_value_get_array(val);
+    TEST(json_array_get_count(arr) == 3);
+    TEST(json_array_get_number(arr, 1) == 2.5);
+    TEST(json_array_append_strings(arr, strings, NULL, 1) == JSONSuccess);
+    TEST(json_array_append_strings(arr, strings, lens, 3) == JSONSuccess);
+    TEST(json_array_get_count(arr) == 7);
+    TEST(json_array_get_string_len(arr, 5) == 3);
+    TEST(json_array_get_string_len(arr, 6) == 56);
+    serialized = json_serialize_to_string(val);
+    TEST(STREQ(serialized, "[1,2.5,-3,\"a\",\"a\",\"b\\u0000c\",\"a string that is too long to be stored inside of a value\"]"));
+    json_free_serialized_string(serialized);
+
+    /* failed bulk appends don't change the array */
+    bad_numbers[0] = 4.0;
+    bad_numbers[1] = bad_numbers[0] * 1e308 * 10; /* inf */
+    TEST(json_array_append_numbers(arr, bad_numbers, 2) == JSONFailure);
+    TEST(json_array_append_numbers(NULL, numbers, 3) == JSONFailure);
+    TEST(json_array_append_numbers(arr, NULL, 0) == JSONSuccess);
+    TEST(json_array_get_count(arr) == 7);
+    json_value_free(val);
+    TEST(g_malloc_count == 0);
+}
+
+void test_packed_arrays(void) {
+    const char *files[] = { "test_1_1.txt", "test_1_3.txt", "test_2.txt" };
+    const char *json = "{\"nums\": [1, 2.5, -3e2, 4], \"bools\": [true, false, true], \"mixed\": [1, true, \"a\"]}";
+    JSON_Parse_Options options;
+    JSON_Value *packed_val = NULL, *boxed_val = NULL, *copy = NULL, *schema = NULL;
+    JSON_Array *nums = NULL, *bools = NULL;
+    char *packed_str = NULL, *boxed_str = NULL;
+    size_t i = 0;
+
+    g_malloc_count = 0;
+    json_parse_options_init(&options);
+    options.pack_arrays = 1;
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        packed_val = json_parse_file_ex(get_file_path(files[i]), &options);
+        boxed_val = json_parse_file(get_file_path(files[i]));
+        TEST(packed_val != NULL);
+        TEST(json_value_equals(packed_val, boxed_val));
+        packed_str = json_serialize_to_string_pretty(packed_val);
+        boxed_str = json_serialize_to_string_pretty(boxed_val);
+        TEST(STREQ(packed_str, boxed_str));
+        json_free_serialized_string(packed_str);
+        json_free_serialized_string(boxed_str);
+        json_value_free(packed_val);
+        json_value_free(boxed_val);
+    }
+
+    packed_val = json_parse_string_ex(json, &options);
+    nums = json_object_get_array(json_object(packed_val), "nums");
+    bools = json_object_get_array(json_object(packed_val), "bools");
+    TEST(json_array_get_numbers(nums) != NULL);
+    TEST(json_array_get_numbers(nums)[2] == -300);
+    TEST(json_array_get_numbers(json_object_get_array(json_object(packed_val), "mixed")) == NULL);
+    TEST(json_array_get_boolean(bools, 1) == 0);
+    TEST(json_array_get_boolean(bools, 2) == 1);
+    TEST(json_array_get_item_type(bools, 0) == JSONBoolean);
+    TEST(json_array_get_string(nums, 0) == NULL);
+
+    copy = json_value_deep_copy(packed_val);
+    TEST(json_array_get_numbers(json_object_get_array(json_object(copy), "nums")) != NULL);
+    TEST(json_value_equals(copy, packed_val));
+    schema = json_parse_string("{\"nums\": [0], \"bools\": [false]}");
+    TEST(json_validate(schema, packed_val) == JSONSuccess);
+    json_value_free(schema);
+    schema = json_parse_string("{\"nums\": [\"\"]}");
+    TEST(json_validate(schema, packed_val) == JSONFailure);
+    json_value_free(schema);
+
+    /* same-type changes keep arrays packed */
+    TEST(json_array_append_number(nums, 5) == JSONSuccess);
+    TEST(json_array_replace_number(nums, 0, 10) == JSONSuccess);
+    TEST(json_array_remove(nums, 1) == JSONSuccess);
+    TEST(json_array_append_boolean(bools, 0) == JSONSuccess);
+    TEST(json_array_remove(bools, 0) == JSONSuccess);
+    TEST(json_array_get_numbers(nums) != NULL);
+    TEST(json_array_get_count(nums) == 4);
+    TEST(json_array_get_number(nums, 0) == 10 && json_array_get_number(nums, 3) == 5);
+    TEST(!json_value_equals(copy, packed_val));
+    boxed_str = json_serialize_to_string(packed_val);
+    TEST(STREQ(boxed_str, "{\"nums\":[10,-300,4,5],\"bools\":[false,true,false],\"mixed\":[1,true,\"a\"]}"));
+    json_free_serialized_string(boxed_str);
+
+    /* other items and json_array_unpack unpack them, json_array_get_value doesn't */
+    TEST(json_array_append_string(nums, "x") == JSONSuccess);
+    TEST(json_array_get_numbers(nums) == NULL);
+    TEST(json_array_get_number(nums, 3) == 5);
+    TEST(json_array_get_value(bools, 2) == NULL);
+    TEST(json_array_get_boolean(bools, 2) == 0);
+    TEST(json_array_unpack(bools) == JSONSuccess);
+    TEST(json_array_unpack(bools) == JSONSuccess);
+    TEST(json_array_unpack(NULL) == JSONFailure);
+    TEST(json_value_get_boolean(json_array_get_value(bools, 2)) == 0);
+#ifndef PARSON_COMPACT_VALUES
+    TEST(json_value_get_parent(json_array_get_value(bools, 2)) == json_array_get_wrapping_value(bools));
+#endif
+    TEST(json_array_pack(bools) == JSONSuccess);
+    TEST(json_array_pack(nums) == JSONFailure);
+    TEST(json_array_clear(bools) == JSONSuccess);
+    TEST(json_array_pack(bools) == JSONFailure);
+
+    json_value_free(copy);
+    json_value_free(packed_val);
+    TEST(g_malloc_count == 0);
+
+    packed_val = json_parse_string_ex("[1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20]", &options);
+    TEST(g_malloc_count == 2); /* value with header and numbers */
+    json_value_free(packed_val);
+}
+
+static int counting_serialization_func_calls = 0;
+static int counting_serialization_func(double num, char *buf) {
+    counting_serialization_func_calls++;
+    return sprintf(buf, "%g", num);
+}
+
+void test_single_pass_serialization(void) {
+    JSON_Serialize_Options options;
+    JSON_Value *val = NULL;
+    char *serialized = NULL;
+    char buf[128];
+    size_t size = 0, i = 0;
+
+    g_malloc_count = 0;
+    val = json_parse_file(get_file_path("test_2.txt"));
+    json_serialize_options_init(&options);
+    options.number_serialization_function = counting_serialization_func;
+    serialized = json_serialize_to_string_ex(val, &options);
+    TEST(serialized != NULL);
+    TEST(g_malloc_count > 0);
+    size = json_serialization_size_ex(val, &options);
+    TEST(size == strlen(serialized) + 1);
+    json_free_serialized_string(serialized);
+    json_value_free(val);
+
+    /* every number is formatted once */
+    val = json_parse_string("[1, 2, 3, {\"a\": 4}]");
+    counting_serialization_func_calls = 0;
+    serialized = json_serialize_to_string_ex(val, &options);
+    TEST(STREQ(serialized, "[1,2,3,{\"a\":4}]"));
+    TEST(counting_serialization_func_calls == 4);
+    json_free_serialized_string(serialized);
+
+    /* fixed buffers detect truncation at any length */
+    size = json_serialization_size(val);
+    for (i = 1; i < size; i++) {
+        memset(buf, 'x', sizeof(buf));
+        TEST(json_serialize_to_buffer(val, buf, i) == JSONFailure);
+        TEST(buf[0] == '\0');
+    }
+    TEST(json_serialize_to_buffer(val, buf, size) == JSONSuccess);
+    TEST(strcmp(buf, "[1,2,3,{\"a\":4}]") == 0);
+    json_value_free(val);
+    TEST(g_malloc_count == 0);
+}
+
+typedef struct stream_output {
+    char   *data;
+    size_t  len;
+    size_t  capacity;
+    size_t  calls;
+    size_t  fail_after; /* calls before failing, 0 never fails */
+} stream_output_t;
+
+static JSON_Status collect_stream_output(void *ctx, const char *data, size_t len) {
+    stream_output_t *out = (stream_output_t*)ctx;
+    out->calls++;
+    if (out->fail_after > 0 && out->calls >= out->fail_after) {
+        return JSONFailure;
+    }
+    if (out->len + len > out->capacity) {
+        return JSONFailure;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return JSONSuccess;
+}
+
+void test_stream_serialization(void) {
+    JSON_Value *val = NULL;
+    JSON_Array *arr = NULL;
+    stream_output_t out;
+    char *serialized = NULL;
+    char *long_string = NULL;
+    char file_buf[64];
+    size_t size = 0, i = 0;
+    FILE *fp = NULL;
+
+    val = json_value_init_array();
+    arr = json_value_get_array(val);
+    for (i = 0; i < 1000; i++) {
+        json_array_append_string(arr, "some \"escaped\" text");
+        json_array_append_number(arr, (double)i / 8);
+    }
+    long_string = (char*)malloc(10000);
+    memset(long_string, 'x', 9999);
+    long_string[9999] = '\0';
+    json_array_append_string(arr, long_string); /* longer than the stream buffer */
+    free(long_string);
+
+    serialized = json_serialize_to_string(val);
+    size = strlen(serialized);
+    memset(&out, 0, sizeof(out));
+    out.capacity = size;
+    out.data = (char*)malloc(size);
+    TEST(json_serialize_to_stream(val, collect_stream_output, &out) == JSONSuccess);
+    TEST(out.len == size);
+    TEST(memcmp(out.data, serialized, size) == 0);
+    TEST(out.calls > 1);
+
+    /* errors of the write function stop serialization */
+    out.len = 0;
+    out.calls = 0;
+    out.fail_after = 2;
+    TEST(json_serialize_to_stream(val, collect_stream_output, &out) == JSONFailure);
+    TEST(out.calls == 2);
+    TEST(json_serialize_to_stream(val, NULL, &out) == JSONFailure);
+    free(out.data);
+    json_free_serialized_string(serialized);
+    json_value_free(val);
+
+    /* FILE* and file descriptors */
+    val = json_parse_string("{\"a\":[1,true,null],\"b\":\"c\"}");
+    fp = tmpfile();
+    TEST(fp != NULL);
+    TEST(json_serialize_to_fp(val, fp, NULL) == JSONSuccess);
+    rewind(fp);
+    size = fread(file_buf, 1, sizeof(file_buf) - 1, fp);
+    file_buf[size] = '\0';
+    TEST(strcmp(file_buf, "{\"a\":[1,true,null],\"b\":\"c\"}") == 0);
+    fclose(fp);
+    TEST(json_serialize_to_fp(val, NULL, NULL) == JSONFailure);
+    TEST(json_serialize_to_fd(val, -1, NULL) == JSONFailure);
+
+    /* failing values leave existing files unchanged */
+    TEST(json_serialize_to_file(val, get_file_path("test_stream_serialized.txt")) == JSONSuccess);
+    TEST(json_serialize_to_file(NULL, get_file_path("test_stream_serialized.txt")) == JSONFailure);
+    serialized = read_file(get_file_path("test_stream_serialized.txt"));
+    TEST(serialized != NULL && strcmp(serialized, "{\"a\":[1,true,null],\"b\":\"c\"}") == 0);
+    free(serialized);
+    remove(get_file_path("test_stream_serialized.txt"));
+    json_value_free(val);
+}
+
+void test_shortest_numbers(void) {
+    const double numbers[] = {
+        0.1, 0.6, -3.14, 1e-5, 0.0001, 123456.789, 1e17, 1e21, -2.5e-300,
+        5e-324, 1.7976931348623157e308, 6.9041432094973937e-310, 9007199254740993.0, 0.3,
+        30892612233637952.0, -66766885433589619.0, 2.718316374298659e276
+    };
+    const char *expected[] = {
+        "0.1", "0.6", "-3.14", "1e-05", "0.0001", "123456.789", "1e+17", "1e+21", "-2.5e-300",
+        "5e-324", "1.7976931348623157e+308", "6.9041432094974e-310", "9007199254740992", "0.3",
+        "30892612233637950", "-66766885433589620", "2.718316374298659e+276" /* found without grisu */
+    };
+    JSON_Value *val = NULL;
+    char buf[64];
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        val = json_value_init_number(numbers[i]);
+        TEST(json_serialize_to_buffer(val, buf, sizeof(buf)) == JSONSuccess);
+        TEST(strcmp(buf, expected[i]) == 0);
+        TEST(strtod(buf, NULL) == numbers[i]);
+        json_value_free(val);
+    }
+
+    /* integers are printed without a fraction or exponent below 2^53 */
+    val = json_parse_string("[0, -0, 42, -1000000, 4503599627370496.0, 1e15]");
+    TEST(json_serialize_to_buffer(val, buf, sizeof(buf)) == JSONSuccess);
+    TEST(strcmp(buf, "[0,-0,42,-1000000,4503599627370496,1000000000000000]") == 0);
+    json_value_free(val);
+}
+
+void test_string_escaping(void) {
+    const char *specials[] = { "\"", "\\", "/", "\n", "\x01", "\x1f", "\xc3\xa9" };
+    const char *escaped[] = { "\\\"", "\\\\", "\\/", "\\n", "\\u0001", "\\u001f", "\xc3\xa9" };
+    char string[64], expected[128], serialized[128];
+    JSON_Value *val = NULL;
+    size_t i = 0, offset = 0, special_len = 0;
+
+    /* escapes are found at any position relative to word boundaries */
+    for (i = 0; i < sizeof(specials) / sizeof(specials[0]); i++) {
+        special_len = strlen(specials[i]);
+        for (offset = 0; offset < 20; offset++) {
+            memset(string, 'a', offset);
+            memcpy(string + offset, specials[i], special_len);
+            memset(string + offset + special_len, 'b', 20);
+            string[offset + special_len + 20] = '\0';
+            sprintf(expected, "\"%.*s%s%.20s\"", (int)offset, string, escaped[i], string + offset + special_len);
+            val = json_value_init_string(string);
+            TEST(json_serialize_to_buffer(val, serialized, sizeof(serialized)) == JSONSuccess);
+            TEST(strcmp(serialized, expected) == 0);
+            TEST(json_serialization_size(val) == strlen(expected) + 1);
+            json_value_free(val);
+        }
+    }
+
+    json_set_escape_slashes(0);
+    val = json_value_init_string("http://example.com/a\"b");
+    TEST(json_serialize_to_buffer(val, serialized, sizeof(serialized)) == JSONSuccess);
+    TEST(strcmp(serialized, "\"http://example.com/a\\\"b\"") == 0);
+    json_value_free(val);
+    json_set_escape_slashes(1);
+}
+
+void test_serialization_cache(void) {
+    JSON_Value *root = NULL, *uncached = NULL;
+    JSON_Object *obj = NULL;
+    char *serialized = NULL, *expected = NULL;
+    char buf[256];
+    int malloc_count = 0, i = 0, stale_count = 0;
+
+    root = json_parse_string("{\"config\": {\"a\": 1, \"b\": [1, 2, {\"c\": \"d\"}]}, \"flags\": [true, false], \"n\": null}");
+    obj = json_object(root);
+#ifdef PARSON_COMPACT_VALUES
+    TEST(json_value_set_serialization_cache(root, 1) == JSONFailure);
+    json_value_free(root);
+    return;
+#endif
+    TEST(json_value_set_serialization_cache(json_object_get_value(obj, "n"), 1) == JSONFailure);
+    TEST(json_value_set_serialization_cache(root, 1) == JSONSuccess);
+    serialized = json_serialize_to_string(root);
+    TEST(STREQ(serialized, "{\"config\":{\"a\":1,\"b\":[1,2,{\"c\":\"d\"}]},\"flags\":[true,false],\"n\":null}"));
+    json_free_serialized_string(serialized);
+
+    /* unchanged output is copied from caches */
+    malloc_count = g_malloc_count;
+    TEST(json_serialize_to_buffer(root, buf, sizeof(buf)) == JSONSuccess);
+    TEST(g_malloc_count == malloc_count);
+    TEST(strcmp(buf, "{\"config\":{\"a\":1,\"b\":[1,2,{\"c\":\"d\"}]},\"flags\":[true,false],\"n\":null}") == 0);
+
+    /* changes anywhere in the tree are visible */
+    TEST(json_object_dotset_string(obj, "config.b.x", "y") == JSONFailure);
+    TEST(json_object_set_string(json_array_get_object(json_object_dotget_array(obj, "config.b"), 2), "c", "e") == JSONSuccess);
+    TEST(json_array_replace_boolean(json_object_get_array(obj, "flags"), 1, 1) == JSONSuccess);
+    TEST(json_object_dotset_number(obj, "config.z.y", 3) == JSONSuccess);
+    TEST(json_object_dotremove(obj, "config.a") == JSONSuccess);
+    TEST(json_serialize_to_buffer(root, buf, sizeof(buf)) == JSONSuccess);
+    TEST(strcmp(buf, "{\"config\":{\"z\":{\"y\":3},\"b\":[1,2,{\"c\":\"e\"}]},\"flags\":[true,true],\"n\":null}") == 0);
+    TEST(json_array_append_null(json_object_dotget_array(obj, "config.b")) == JSONSuccess);
+    TEST(json_array_remove(json_object_dotget_array(obj, "config.b"), 0) == JSONSuccess);
+    TEST(json_array_clear(json_object_get_array(obj, "flags")) == JSONSuccess);
+
+    /* caches are kept per format and nesting level, sizes match output */
+    uncached = json_value_deep_copy(root);
+    expected = json_serialize_to_string_pretty(uncached);
+    serialized = json_serialize_to_string_pretty(root);
+    TEST(STREQ(serialized, expected));
+    TEST(json_serialization_size_pretty(root) == strlen(expected) + 1);
+    json_free_serialized_string(serialized);
+    json_free_serialized_string(expected);
+    expected = json_serialize_to_string(uncached);
+    serialized = json_serialize_to_string(root);
+    TEST(STREQ(serialized, expected));
+    json_free_serialized_string(serialized);
+    serialized = json_serialize_to_string(json_object_get_value(obj, "config"));
+    TEST(STREQ(serialized, "{\"z\":{\"y\":3},\"b\":[2,{\"c\":\"e\"},null]}"));
+    json_free_serialized_string(serialized);
+
+    TEST(json_value_set_serialization_cache(root, 0) == JSONSuccess);
+    serialized = json_serialize_to_string(root);
+    TEST(STREQ(serialized, expected));
+    json_free_serialized_string(serialized);
+    json_free_serialized_string(expected);
+    json_value_free(uncached);
+    json_value_free(root);
+
+    /* containers whose cache couldn't be stored keep their parents' caches from being used */
+    json_set_allocation_functions(failing_malloc, failing_free);
+    g_failing_alloc.fail_once = 1;
+    for (i = 0; ; i++) {
+        g_failing_alloc.should_fail = 0;
+        root = json_parse_string("{\"a\": {\"b\": [1, {\"c\": 2}]}, \"d\": [3]}");
+        json_value_set_serialization_cache(root, 1);
+        g_failing_alloc.allocation_to_fail = i;
+        g_failing_alloc.total_count = 0;
+        g_failing_alloc.has_failed = 0;
+        g_failing_alloc.should_fail = 1;
+        json_free_serialized_string(json_serialize_to_string(root));
+        g_failing_alloc.should_fail = 0;
+        json_object_set_number(json_array_get_object(json_object_dotget_array(json_object(root), "a.b"), 1), "c", 5);
+        serialized = json_serialize_to_string(root);
+        if (!STREQ(serialized, "{\"a\":{\"b\":[1,{\"c\":5}]},\"d\":[3]}")) {
+            stale_count++;
+        }
+        json_free_serialized_string(serialized);
+        json_value_free(root);
+        if (!g_failing_alloc.has_failed) {
+            break;
+        }
+    }
+    g_failing_alloc.fail_once = 0;
+    json_set_allocation_functions(counted_malloc, counted_free);
+    TEST(stale_count == 0);
+}
+
+void test_retained_source(void) {
+    const char *input = " {\"a\" : [1.50, 2e3], \"b\": {\"c\" : \"\\u0041\"} } ";
+    JSON_Parse_Options options;
+    JSON_Serialize_Options ser_options;
+    JSON_Value *root = NULL, *b = NULL;
+    char *serialized = NULL;
+
+    json_parse_options_init(&options);
+    json_serialize_options_init(&ser_options);
+    options.retain_source = 1;
+    root = json_parse_string_ex(input, &options);
+    TEST(root != NULL);
+    serialized = json_serialize_to_string(root);
+#ifdef PARSON_COMPACT_VALUES
+    TEST(STREQ(serialized, "{\"a\":[1.5,2000],\"b\":{\"c\":\"A\"}}"));
+    json_free_serialized_string(serialized);
+    json_value_free(root);
+    return;
+#endif
+    TEST(STREQ(serialized, "{\"a\" : [1.50, 2e3], \"b\": {\"c\" : \"\\u0041\"} }"));
+    TEST(json_serialization_size(root) == strlen(serialized) + 1);
+    json_free_serialized_string(serialized);
+
+    /* only changed containers are serialized again */
+    TEST(json_object_set_null(json_object(root), "n") == JSONSuccess);
+    serialized = json_serialize_to_string(root);
+    TEST(STREQ(serialized, "{\"a\":[1.50, 2e3],\"b\":{\"c\" : \"\\u0041\"},\"n\":null}"));
+    json_free_serialized_string(serialized);
+    TEST(json_array_append_number(json_object_get_array(json_object(root), "a"), 3) == JSONSuccess);
+    serialized = json_serialize_to_string(root);
+    TEST(STREQ(serialized, "{\"a\":[1.5,2000,3],\"b\":{\"c\" : \"\\u0041\"},\"n\":null}"));
+    json_free_serialized_string(serialized);
+
+    /* source text keeps its escapes whether slashes are escaped or not */
+    b = json_parse_string_ex("{\"a\":\"x/y\", \"b\":[\"x\\/y\"]}", &options);
+    ser_options.escape_slashes = 1;
+    serialized = json_serialize_to_string_ex(b, &ser_options);
+    TEST(STREQ(serialized, "{\"a\":\"x/y\", \"b\":[\"x\\/y\"]}"));
+    json_free_serialized_string(serialized);
+    ser_options.escape_slashes = 0;
+    serialized = json_serialize_to_string_ex(b, &ser_options);
+    TEST(STREQ(serialized, "{\"a\":\"x/y\", \"b\":[\"x\\/y\"]}"));
+    json_free_serialized_string(serialized);
+    json_value_free(b);
+
+    /* pretty output doesn't use source text */
+    serialized = json_serialize_to_string_pretty(json_object_get_value(json_object(root), "b"));
+    TEST(STREQ(serialized, "{\n    \"c\": \"A\"\n}"));
+    json_free_serialized_string(serialized);
+
+    /* source text is shared by containers and freed with the last of them */
+    b = json_value_deep_copy(json_object_get_value(json_object(root), "b"));
+    json_value_free(root);
+    serialized = json_serialize_to_string(b);
+    TEST(STREQ(serialized, "{\"c\":\"A\"}"));
+    json_free_serialized_string(serialized);
+    json_value_free(b);
+
+    options.with_comments = 1;
+    root = json_parse_string_ex("[1, /* comment */ {\"a\": 2} // comment\n]", &options);
+    serialized = json_serialize_to_string(json_array_get_value(json_array(root), 1));
+    TEST(STREQ(serialized, "{\"a\": 2}"));
+    json_free_serialized_string(serialized);
+    json_value_free(root);
+}
+
+void test_pretty_layout(void) {
+    JSON_Serialize_Options options;
+    JSON_Value *val = NULL, *inner = NULL;
+    char *serialized = NULL, *expected = NULL;
+    size_t i = 0, len = 0, depth = 100;
+
+    val = json_parse_string("{\"a\": [1, {\"b\": null}], \"c\": {}}");
+    json_serialize_options_init(&options);
+    options.pretty = 1;
+    options.indent = "  ";
+    serialized = json_serialize_to_string_ex(val, &options);
+    TEST(STREQ(serialized, "{\n  \"a\": [\n    1,\n    {\n      \"b\": null\n    }\n  ],\n  \"c\": {}\n}"));
+    TEST(json_serialization_size_ex(val, &options) == strlen(serialized) + 1);
+    json_free_serialized_string(serialized);
+
+    options.indent = "\t";
+    options.newline = "\r\n";
+    serialized = json_serialize_to_string_ex(val, &options);
+    TEST(STREQ(serialized, "{\r\n\t\"a\": [\r\n\t\t1,\r\n\t\t{\r\n\t\t\t\"b\": null\r\n\t\t}\r\n\t],\r\n\t\"c\": {}\r\n}"));
+    json_free_serialized_string(serialized);
+
+    options.indent = "-.";
+    options.newline = NULL;
+    serialized = json_serialize_to_string_ex(val, &options);
+    TEST(STREQ(serialized, "{\n-.\"a\": [\n-.-.1,\n-.-.{\n-.-.-.\"b\": null\n-.-.}\n-.],\n-.\"c\": {}\n}"));
+    json_free_serialized_string(serialized);
+    json_value_free(val);
+
+    /* indentation longer than the precomputed runs */
+    val = json_value_init_array();
+    inner = val;
+    for (i = 1; i < depth; i++) {
+        json_array_append_value(json_array(inner), json_value_init_array());
+        inner = json_array_get_value(json_array(inner), 0);
+    }
+    json_array_append_null(json_array(inner));
+    serialized = json_serialize_to_string_pretty(val);
+    expected = (char*)malloc(depth * depth * 8 + 16);
+    for (i = 0; i < depth; i++) {
+        memset(expected + len, ' ', i * 4);
+        len += i * 4;
+        memcpy(expected + len, "[\n", 2);
+        len += 2;
+    }
+    memset(expected + len, ' ', depth * 4);
+    len += depth * 4;
+    memcpy(expected + len, "null", 4);
+    len += 4;
+    for (i = depth; i > 0; i--) {
+        expected[len++] = '\n';
+        memset(expected + len, ' ', (i - 1) * 4);
+        len += (i - 1) * 4;
+        expected[len++] = ']';
+    }
+    expected[len] = '\0';
+    TEST(STREQ(serialized, expected));
+    free(expected);
+    json_free_serialized_string(serialized);
+    json_value_free(val);
+}
+
+void test_iovec_serialization(void) {
+    JSON_Value *val = NULL;
+    JSON_Object *obj = NULL;
+    JSON_Iovec *iov = NULL;
+    char *long_string = NULL, *serialized = NULL, *joined = NULL;
+    const char *long_value = NULL;
+    size_t i = 0, count = 0, len = 0;
+    int references_value = 0;
+
+    long_string = (char*)malloc(2001);
+    memset(long_string, 'x', 2000);
+    long_string[1000] = '\n'; /* splits it into two long runs */
+    long_string[2000] = '\0';
+    val = json_value_init_object();
+    obj = json_object(val);
+    json_object_set_string(obj, "long", long_string);
+    json_object_set_string(obj, "short", "abc");
+    json_object_dotset_number(obj, "nested.n", 1.5);
+    free(long_string);
+    long_value = json_object_get_string(obj, "long");
+
+    serialized = json_serialize_to_string(val);
+    iov = json_serialize_to_iovec(val, NULL, &count);
+    TEST(iov != NULL);
+    TEST(count > 1);
+    joined = (char*)malloc(strlen(serialized) + 1);
+    for (i = 0; i < count; i++) {
+        TEST(len + iov[i].len <= strlen(serialized));
+        memcpy(joined + len, iov[i].base, iov[i].len);
+        len += iov[i].len;
+        if (iov[i].base == long_value || iov[i].base == long_value + 1001) {
+            references_value++;
+        }
+    }
+    joined[len] = '\0';
+    TEST(STREQ(joined, serialized));
+    TEST(references_value == 2);
+    json_free_iovec(iov);
+    free(joined);
+    json_free_serialized_string(serialized);
+    json_value_free(val);
+
+    /* output without long strings is a single buffer */
+    val = json_parse_string("[1, \"a\", {}]");
+    iov = json_serialize_to_iovec(val, NULL, &count);
+    TEST(count == 1 && iov[0].len == 10 && strncmp(iov[0].base, "[1,\"a\",{}]", 10) == 0);
+    json_free_iovec(iov);
+    TEST(json_serialize_to_iovec(val, NULL, NULL) == NULL);
+    json_value_free(val);
+}
+
+static JSON_Status count_stream_output(void *ctx, const char *data, size_t len) {
+    (void)data;
+    *(size_t*)ctx += len;
+    return JSONSuccess;
+}
+
+void test_large_outputs(void) {
+    const char *temp_filename = "test_large_serialized.txt";
+    JSON_Serialize_Options options;
+    JSON_Value *val = NULL, *from_file = NULL, *inner = NULL;
+    char *long_string = NULL, *indent = NULL;
+    size_t size = 0, streamed = 0, indent_len = 4 * 1024 * 1024;
+    int i = 0;
+
+    /* files larger than the first read chunk */
+    long_string = (char*)malloc(300001);
+    memset(long_string, 'a', 300000);
+    long_string[300000] = '\0';
+    val = json_value_init_array();
+    json_array_append_string(json_array(val), long_string);
+    json_array_append_number(json_array(val), 1);
+    TEST(json_serialize_to_file(val, get_file_path(temp_filename)) == JSONSuccess);
+    from_file = json_parse_file(get_file_path(temp_filename));
+    TEST(json_value_equals(val, from_file));
+    remove(get_file_path(temp_filename));
+    json_value_free(from_file);
+    json_value_free(val);
+    free(long_string);
+
+    /* more than 2^31 bytes of pretty output from 40 nested arrays and a 4 MB indent */
+    if (sizeof(size_t) <= 4) {
+        return;
+    }
+    val = json_value_init_array();
+    inner = val;
+    for (i = 0; i < 40; i++) {
+        json_array_append_value(json_array(inner), json_value_init_array());
+        inner = json_array_get_value(json_array(inner), 0);
+    }
+    indent = (char*)malloc(indent_len + 1);
+    memset(indent, ' ', indent_len);
+    indent[indent_len] = '\0';
+    json_serialize_options_init(&options);
+    options.pretty = 1;
+    options.indent = indent;
+    size = json_serialization_size_ex(val, &options);
+    TEST(size > ((size_t)1 << 31));
+    TEST(json_serialize_to_stream_ex(val, count_stream_output, &streamed, &options) == JSONSuccess);
+    TEST(streamed == size - 1);
+    free(indent);
+    json_value_free(val);
+}
+
+void test_value_hash(void) {
+    JSON_Value *a = NULL, *b = NULL, *copy = NULL, *packed = NULL, *boxed = NULL;
+    const double numbers[] = { 1.5, 2 };
+    unsigned long hash = 0;
+
+    a = json_parse_string("{\"x\": 1, \"y\": [true, null, \"s\"], \"z\": {\"n\": -0}}");
+    b = json_parse_string("{\"z\": {\"n\": 0}, \"y\": [true, null, \"s\"], \"x\": 1}");
+    TEST(json_value_hash(a) == json_value_hash(b));
+    json_object_set_number(json_object(b), "x", 2);
+    TEST(json_value_hash(a) != json_value_hash(b));
+    json_value_free(b);
+
+    b = json_parse_string("[[], {}, 1, 2]");
+    copy = json_parse_string("[{}, [], 1, 2]");
+    TEST(json_value_hash(b) != json_value_hash(copy)); /* order of items matters */
+    json_value_free(copy);
+    copy = json_parse_string("[[], {}, 2, 1]");
+    TEST(json_value_hash(b) != json_value_hash(copy));
+    json_value_free(copy);
+    json_value_free(b);
+
+    /* packed and boxed storage of the same items */
+    packed = json_value_init_array_from_numbers(numbers, 2);
+    boxed = json_parse_string("[1.5, 2]");
+    TEST(json_array_get_numbers(json_array(packed)) != NULL);
+    TEST(json_array_get_numbers(json_array(boxed)) == NULL);
+    TEST(json_value_equals(packed, boxed));
+    TEST(json_value_hash(packed) == json_value_hash(boxed));
+    json_value_free(packed);
+    json_value_free(boxed);
+
+    /* cached hashes are invalidated by changes below them */
+    json_value_set_hash_cache(a, 1);
+    hash = json_value_hash(a);
+    TEST(json_value_hash(a) == hash);
+    TEST(json_object_dotset_number(json_object(a), "z.n", 5) == JSONSuccess);
+    TEST(json_value_hash(a) != hash);
+    copy = json_value_deep_copy(a);
+    TEST(json_value_hash(a) == json_value_hash(copy));
+    TEST(json_array_append_number(json_object_get_array(json_object(a), "y"), 3) == JSONSuccess);
+    TEST(json_value_hash(a) != json_value_hash(copy));
+    TEST(json_array_remove(json_object_get_array(json_object(a), "y"), 3) == JSONSuccess);
+    TEST(json_value_hash(a) == json_value_hash(copy));
+    json_value_free(copy);
+    TEST(json_value_set_hash_cache(json_object_get_value(json_object(a), "x"), 1) == JSONFailure);
+    json_value_free(a);
+
+    /* keys were hashed already, so the seed can't change */
+    TEST(json_set_hash_seed(1, 2) == JSONFailure);
+}
+
+void test_dedupe(void) {
+    const char *rows = "{\"rows\": ["
+                       "{\"id\": 1, \"price\": {\"currency\": \"USD\", \"precision\": 2}, \"tags\": [\"a\"]},"
+                       "{\"id\": 2, \"price\": {\"currency\": \"USD\", \"precision\": 2}, \"tags\": [\"a\"]},"
+                       "{\"id\": 3, \"price\": {\"precision\": 2, \"currency\": \"USD\"}, \"tags\": []},"
+                       "{\"id\": 4, \"price\": {\"currency\": \"USD\", \"precision\": 2.0000001}, \"tags\": [\"a\"]}"
+                       "], \"last\": {\"currency\": \"USD\", \"precision\": 2}}";
+    JSON_Parse_Options options;
+    JSON_Value *val = NULL, *copy = NULL, *price = NULL;
+    JSON_Array *rows_arr = NULL;
+    char *before = NULL, *after = NULL;
+
+    val = json_parse_string(rows);
+#ifdef PARSON_COMPACT_VALUES
+    TEST(json_value_dedupe(val) == JSONFailure);
+    json_value_free(val);
+    return;
+#endif
+    copy = json_value_deep_copy(val);
+    before = json_serialize_to_string(val);
+    TEST(json_value_dedupe(val) == JSONSuccess);
+    after = json_serialize_to_string(val);
+    TEST(STREQ(before, after));
+    TEST(json_value_equals(val, copy));
+    rows_arr = json_object_get_array(json_object(val), "rows");
+    price = json_object_get_value(json_array_get_object(rows_arr, 0), "price");
+    TEST(json_object_get_value(json_array_get_object(rows_arr, 1), "price") == price);
+    TEST(json_object_get_value(json_array_get_object(rows_arr, 2), "price") != price); /* keys in another order */
+    TEST(json_object_get_value(json_array_get_object(rows_arr, 3), "price") != price); /* numbers have to be exact */
+    TEST(json_object_get_value(json_object(val), "last") == price);
+    TEST(json_object_get_value(json_array_get_object(rows_arr, 0), "tags")
+         == json_object_get_value(json_array_get_object(rows_arr, 1), "tags"));
+    TEST(json_value_get_parent(price) == NULL);
+
+    /* shared subtrees are frozen, everything around them can change */
+    TEST(json_object_set_number(json_object(price), "precision", 3) == JSONFailure);
+    TEST(json_object_dotset_number(json_object(val), "last.precision", 3) == JSONFailure);
+    TEST(json_array_append_number(json_object_get_array(json_array_get_object(rows_arr, 0), "tags"), 1) == JSONFailure);
+    TEST(json_object_set_value(json_object(val), "again", price) == JSONFailure);
+    TEST(json_object_reserve(json_object(price), 100) == JSONFailure);
+    TEST(json_array_reserve(json_object_get_array(json_array_get_object(rows_arr, 0), "tags"), 100) == JSONFailure);
+    TEST(json_value_shrink_to_fit(val) == JSONSuccess);
+    TEST(json_object_set_number(json_array_get_object(rows_arr, 0), "id", 10) == JSONSuccess);
+    TEST(json_object_remove(json_array_get_object(rows_arr, 1), "price") == JSONSuccess);
+    TEST(json_array_remove(rows_arr, 0) == JSONSuccess);
+    TEST(STREQ(json_object_get_string(json_object(price), "currency"), "USD")); /* still held by "last" */
+    TEST(json_value_get_parent(price) == NULL);
+    TEST(json_value_dedupe(val) == JSONSuccess); /* again, with shared values already inside */
+    json_free_serialized_string(before);
+    json_free_serialized_string(after);
+    json_value_free(val);
+
+    json_parse_options_init(&options);
+    options.dedupe = 1;
+    val = json_parse_string_ex(rows, &options);
+    TEST(json_value_equals(val, copy));
+    rows_arr = json_object_get_array(json_object(val), "rows");
+    TEST(json_object_get_value(json_array_get_object(rows_arr, 0), "price")
+         == json_object_get_value(json_array_get_object(rows_arr, 1), "price"));
+    json_value_free(val);
+    json_value_free(copy);
+    TEST(json_value_dedupe(NULL) == JSONFailure);
+}
+
+void test_interned_strings(void) {
+    const char *doc = "[{\"status\": \"waiting for payment\", \"country\": \"United States of America\"},"
+                      " {\"status\": \"waiting for payment\", \"country\": \"United States of America\"},"
+                      " {\"status\": \"waiting\\u0020for payment\", \"note\": \"ok\"},"
+                      " \"ok\", \"waiting for payment\"]";
+    JSON_Parse_Options options;
+    JSON_Value *val = NULL, *copy = NULL;
+    JSON_Array *arr = NULL;
+    const char *status = NULL;
+    char *long_doc = NULL, *serialized = NULL;
+
+    json_parse_options_init(&options);
+    options.intern_strings = 1;
+    val = json_parse_string_ex(doc, &options);
+    arr = json_array(val);
+    status = json_object_get_string(json_array_get_object(arr, 0), "status");
+    TEST(STREQ(status, "waiting for payment"));
+    TEST(json_object_get_string(json_array_get_object(arr, 1), "status") == status);
+    TEST(json_object_get_string(json_array_get_object(arr, 2), "status") == status); /* compared unescaped */
+    TEST(json_array_get_string(arr, 4) == status);
+    TEST(json_object_get_string(json_array_get_object(arr, 0), "country")
+         == json_object_get_string(json_array_get_object(arr, 1), "country"));
+
+    /* deep copies get their own characters, interned ones live until the last value using them is freed */
+    copy = json_value_deep_copy(json_array_get_value(arr, 0));
+    TEST(json_object_get_string(json_object(copy), "status") != status);
+    TEST(STREQ(json_object_get_string(json_object(copy), "status"), status));
+    TEST(json_array_remove(arr, 4) == JSONSuccess);
+    json_value_free(val);
+    TEST(STREQ(json_object_get_string(json_object(copy), "status"), "waiting for payment"));
+    TEST(json_object_set_string(json_object(copy), "status", "paid") == JSONSuccess);
+    serialized = json_serialize_to_string(copy);
+    TEST(STREQ(serialized, "{\"status\":\"paid\",\"country\":\"United States of America\"}"));
+    json_free_serialized_string(serialized);
+    json_value_free(copy);
+
+    /* long strings are not interned */
+    long_doc = (char*)malloc(2 * 200 + 8);
+    strcpy(long_doc, "[\"");
+    memset(long_doc + 2, 'x', 100);
+    strcpy(long_doc + 102, "\",\"");
+    memset(long_doc + 105, 'x', 100);
+    strcpy(long_doc + 205, "\"]");
+    val = json_parse_string_ex(long_doc, &options);
+    TEST(json_array_get_string_len(json_array(val), 0) == 100);
+    TEST(json_array_get_string(json_array(val), 0) != json_array_get_string(json_array(val), 1));
+    json_value_free(val);
+    free(long_doc);
+}
+
+void test_canonical_serialization(void) {
+    JSON_Serialize_Options options;
+    JSON_Value *a = NULL, *b = NULL;
+    char *a_serialized = NULL, *b_serialized = NULL;
+    char key[16];
+    int i = 0;
+
+    json_serialize_options_init(&options);
+    options.canonical = 1;
+    options.pretty = 1; /* ignored */
+    options.float_format = "%.2f"; /* ignored */
+    a = json_parse_string("{\"\\ufb01\": \"/\", \"b\": 1, \"\\ud83d\\ude00\": \"x\\u001f\\n\","
+                          " \"a\": {\"z\": true, \"\\u00e9\": null, \"y\": [1e21, -0, 0.1, 1e-7, 123.456]}}");
+    a_serialized = json_serialize_to_string_ex(a, &options);
+    /* U+1F600 is a surrogate pair in UTF-16, so it sorts before U+FB01 */
+    TEST(STREQ(a_serialized, "{\"a\":{\"y\":[1e+21,0,0.1,1e-7,123.456],\"z\":true,\"\xc3\xa9\":null},\"b\":1,"
+                             "\"\xf0\x9f\x98\x80\":\"x\\u001f\\n\",\"\xef\xac\x81\":\"/\"}"));
+    json_free_serialized_string(a_serialized);
+    json_value_free(a);
+
+    /* numbers are the same as JSON.stringify's, large integers included */
+    a = json_value_init_array();
+    json_array_append_number(json_array(a), 30892612233637952.0);
+    json_array_append_number(json_array(a), -66766885433589619.0);
+    json_array_append_number(json_array(a), 2.718316374298659e276);
+    json_array_append_number(json_array(a), 1152921504606846976.0); /* 2^60 */
+    json_array_append_number(json_array(a), 5e-324);
+    json_array_append_number(json_array(a), 1e23);
+    json_array_append_number(json_array(a), 9007199254740993.0);
+    a_serialized = json_serialize_to_string_ex(a, &options);
+    TEST(STREQ(a_serialized, "[30892612233637950,-66766885433589620,2.718316374298659e+276,1152921504606847000,"
+                             "5e-324,1e+23,9007199254740992]"));
+    json_free_serialized_string(a_serialized);
+    json_value_free(a);
+
+    /* equal values serialize the same regardless of insertion and removal order */
+    a = json_value_init_object();
+    b = json_value_init_object();
+    for (i = 0; i < 40; i++) {
+        sprintf(key, "k%d", i);
+        json_object_set_number(json_object(a), key, i);
+        sprintf(key, "k%d", 39 - i);
+        json_object_set_number(json_object(b), key, 39 - i);
+    }
+    json_object_set_null(json_object(b), "removed");
+    json_object_remove(json_object(b), "k0");
+    json_object_remove(json_object(b), "removed");
+    json_object_set_number(json_object(b), "k0", 0);
+    a_serialized = json_serialize_to_string_ex(a, &options);
+    b_serialized = json_serialize_to_string_ex(b, &options);
+    TEST(STREQ(a_serialized, b_serialized));
+    TEST(strncmp(a_serialized, "{\"k0\":0,\"k1\":1,\"k10\":10,\"k11\":11,", 33) == 0);
+    TEST(json_serialization_size_ex(a, &options) == strlen(a_serialized) + 1);
+    json_free_serialized_string(a_serialized);
+    json_free_serialized_string(b_serialized);
+    json_value_free(a);
+    json_value_free(b);
+}
+
+void test_compiled_schema(void) {
+    const char *schemas[] = {
+        "null", "0", "\"\"", "true", "[]", "{}", "[0]", "[false]", "[\"\"]", "[null]", "[{}]",
+        "{\"a\": 0}", "{\"a\": null, \"b\": \"\"}", "{\"a\": [0], \"b\": {\"c\": [true]}}",
+        "{\"a\": [{\"x\": 0, \"y\": [\"\"]}], \"b\": {}}", "[[[{\"k\": [[0]]}]]]", "[[0], [\"\"]]"
+    };
+    const char *values[] = {
+        "null", "1", "\"s\"", "false", "[]", "{}", "[1, 2, 3]", "[true, false]", "[\"a\", \"b\"]",
+        "[1, \"a\"]", "[{}, {\"a\": 1}]", "{\"a\": 1}", "{\"b\": 1}", "{\"a\": 1, \"b\": \"x\", \"c\": 2}",
+        "{\"a\": [1, 2], \"b\": {\"c\": [true]}}", "{\"a\": [1, \"x\"], \"b\": {\"c\": [true, 1]}}",
+        "{\"a\": [{\"x\": 1, \"y\": [\"p\", \"q\"]}, {\"x\": 2, \"y\": []}], \"b\": {\"z\": 0}}",
+        "{\"a\": [{\"x\": 1, \"y\": [\"p\", 3]}], \"b\": {}}", "{\"a\": [{\"y\": []}], \"b\": {}}",
+        "[[[{\"k\": [[1, 2], [3]]}]]]", "[[[{\"k\": [[1, true]]}]]]", "[[[{\"k\": [1]}]]]", "[[1], [2]]"
+    };
+    JSON_Value *val_from_file = json_parse_file(get_file_path("test_5.txt"));
+    JSON_Value *schema = NULL, *value = NULL;
+    JSON_Schema *compiled = NULL;
+    char *deep = NULL;
+    size_t i = 0, j = 0;
+    int mismatches = 0;
+
+    for (i = 0; i < sizeof(schemas) / sizeof(schemas[0]); i++) {
+        schema = json_parse_string(schemas[i]);
+        compiled = json_schema_compile(schema);
+        for (j = 0; j < sizeof(values) / sizeof(values[0]); j++) {
+            value = json_parse_string(values[j]);
+            if (json_schema_check(compiled, value) != json_validate(schema, value)) {
+                mismatches++;
+            }
+            json_value_free(value);
+        }
+        json_schema_free(compiled);
+        json_value_free(schema);
+    }
+    TEST(mismatches == 0);
+
+    /* the compiled schema doesn't depend on the original */
+    schema = json_parse_string("{\"first\": \"\", \"last\": \"\", \"age\": 0, \"interests\": [\"\"], \"favorites\": null}");
+    compiled = json_schema_compile(schema);
+    json_value_free(schema);
+    TEST(json_schema_check(compiled, val_from_file) == JSONSuccess);
+    TEST(json_schema_check(compiled, json_object_get_value(json_object(val_from_file), "favorites")) == JSONFailure);
+    json_schema_free(compiled);
+
+    /* deeper than the check's preallocated stack */
+    deep = (char*)malloc(200 * 2 + 3);
+    for (i = 0; i < 200; i++) {
+        deep[i] = '[';
+        deep[202 + i] = ']';
+    }
+    deep[200] = ' ';
+    deep[201] = '0';
+    deep[402] = '\0';
+    schema = json_parse_string(deep);
+    compiled = json_schema_compile(schema);
+    TEST(json_schema_check(compiled, schema) == JSONSuccess);
+    deep[200] = '"';
+    deep[201] = '"';
+    value = json_parse_string(deep);
+    TEST(value != NULL);
+    TEST(json_schema_check(compiled, value) == JSONFailure);
+    TEST(json_validate(schema, value) == JSONFailure);
+    json_value_free(value);
+    json_value_free(schema);
+    json_schema_free(compiled);
+    free(deep);
+
+    TEST(json_schema_compile(NULL) == NULL);
+    TEST(json_schema_check(NULL, val_from_file) == JSONFailure);
+    json_schema_free(NULL);
+    json_value_free(val_from_file);
+}
+
 void print_commits_info(const char *username, const char *repo) {
     JSON_Value *root_value;
     JSON_Array *commits;
@@ -890,9 +2240,40 @@ static void counted_free(void *ptr) {
     free(ptr);
 }
 
+static void *pool_malloc(void *ctx, size_t size) {
+    pool_stats_t *stats = (pool_stats_t*)ctx;
+    void *res = malloc(size);
+    if (res != NULL) {
+        stats->live++;
+        stats->mallocs++;
+    }
+    return res;
+}
+
+static void *pool_realloc(void *ctx, void *ptr, size_t size) {
+    pool_stats_t *stats = (pool_stats_t*)ctx;
+    void *res = realloc(ptr, size);
+    if (res != NULL) {
+        stats->reallocs++;
+        if (ptr == NULL) {
+            stats->live++;
+        }
+    }
+    return res;
+}
+
+static void pool_free(void *ctx, void *ptr) {
+    pool_stats_t *stats = (pool_stats_t*)ctx;
+    if (ptr != NULL) {
+        stats->live--;
+    }
+    free(ptr);
+}
+
 static void *failing_malloc(size_t size) {
     void *res = NULL;
-    if (g_failing_alloc.should_fail && g_failing_alloc.total_count >= g_failing_alloc.allocation_to_fail) {
+    if (g_failing_alloc.should_fail && g_failing_alloc.total_count >= g_failing_alloc.allocation_to_fail
+        && !(g_failing_alloc.fail_once && g_failing_alloc.has_failed)) {
         g_failing_alloc.has_failed = 1;
         return NULL;
     }